@@ -0,0 +1,266 @@
+/**
+ * ** Microbenchmark harness **
+ * Several optimizations in this repo claim big cycle savings: port
+ * reads over digitalRead, FastPin over digitalWrite, the PROGMEM logic
+ * table over expression evaluation, the hex table over sscanf. This
+ * sketch puts numbers on them so claims can be accepted or rejected on
+ * measurements instead of folklore.
+ *
+ * Method: Timer1 free-runs at the CPU clock, so TCNT1 counts cycles.
+ * Each kernel runs a fixed iteration count with interrupts off, the
+ * empty-loop overhead is measured the same way and subtracted, and the
+ * result prints as cycles per operation in hundredths. Reset the board
+ * (or send any serial byte) to rerun.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#include <avr/pgmspace.h>
+#include <FastPin.h>
+
+// Pins the kernels poke; 13 is the LED, 2 is a free input.
+const int outPin = 13;
+const int inPin = 2;
+
+// Volatile sinks and sources keep the optimizer from deleting kernels.
+volatile uint8_t sink8;
+volatile int sinkInt;
+volatile uint8_t source8 = 0xA5;
+
+// Iteration counts sized so no measurement overflows 16 bits of TCNT1:
+// light kernels get many iterations for resolution, heavy ones few.
+// The harness checks the overflow flag anyway and refuses to report a
+// wrapped count, since libc routines like sscanf give no cycle budget
+// guarantees.
+const uint16_t lightIterations = 512;
+const uint16_t heavyIterations = 32;
+
+// A 3 digit hex parser and table copied from ColorPal's hot path.
+const uint8_t hexTable[256] PROGMEM =
+{
+#define HEX_ROW_FF 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, \
+                   0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+  HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  HEX_ROW_FF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF,
+  HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF, HEX_ROW_FF,
+};
+
+int parseHex3(const char * p)
+{
+  uint8_t hi = pgm_read_byte(&hexTable[(uint8_t)p[0]]);
+  uint8_t mid = pgm_read_byte(&hexTable[(uint8_t)p[1]]);
+  uint8_t lo = pgm_read_byte(&hexTable[(uint8_t)p[2]]);
+
+  if ((hi | mid | lo) & 0xF0)
+    return -1;
+
+  return ((int)hi << 8) | ((int)mid << 4) | lo;
+}
+
+// A stand-in for CosmacElf's logic: same shape of expression and an
+// equivalent 256 entry table (contents don't matter for timing).
+const uint8_t logicLut[256] PROGMEM = { 0 };
+
+// -----[ Harness ]---------------------------------------------------------
+
+// Set when the last measurement ran Timer1 past 65536 cycles; the
+// count that came back is garbage and must not be reported as a
+// number.
+bool measureOverflowed;
+
+// Run a kernel with interrupts off and return raw Timer1 cycles.
+unsigned int measure(void (*kernel)())
+{
+  noInterrupts();
+  TCNT1 = 0;
+  TIFR1 = _BV(TOV1);  // writing 1 clears the stale overflow flag
+  kernel();
+  unsigned int cycles = TCNT1;
+  measureOverflowed = (TIFR1 & _BV(TOV1)) != 0;
+  interrupts();
+  return cycles;
+}
+
+unsigned int lightOverhead;
+unsigned int heavyOverhead;
+
+void emptyLight()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    ;
+}
+
+void emptyHeavy()
+{
+  for (volatile uint16_t i = 0; i < heavyIterations; i++)
+    ;
+}
+
+// Print one table row: label, then net cycles per op in hundredths.
+void report(const __FlashStringHelper * label, void (*kernel)(),
+            unsigned int overhead, uint16_t iterations)
+{
+  unsigned int raw = measure(kernel);
+  if (measureOverflowed)
+  {
+    // Better no number than a small wrong one.
+    Serial.print(label);
+    Serial.println(F(": overflow, shrink the iteration count"));
+    return;
+  }
+  unsigned long net = (raw > overhead) ? raw - overhead : 0;
+  unsigned long hundredths = net * 100 / iterations;
+
+  Serial.print(label);
+  Serial.print(F(": "));
+  Serial.print(hundredths / 100);
+  Serial.print('.');
+  unsigned int frac = hundredths % 100;
+  if (frac < 10)
+    Serial.print('0');
+  Serial.print(frac);
+  Serial.println(F(" cycles/op"));
+}
+
+// -----[ Kernels ]---------------------------------------------------------
+
+void kernelDigitalWrite()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    digitalWrite(outPin, i & 1);
+}
+
+void kernelFastPin()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    FastPin<outPin>::toggle();
+}
+
+void kernelDigitalRead()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    sink8 = digitalRead(inPin);
+}
+
+void kernelPortRead()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    sink8 = (PIND >> 2) | ((PINB & 0x01) << 6);
+}
+
+// The glue logic equations the way CosmacElf used to evaluate them.
+void kernelLogicExpression()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+  {
+    uint8_t in = source8;
+    uint8_t out = 0;
+    if (in & 0x04) out |= 0x01;
+    if (!(!(in & 0x10) && (in & 0x01) && ((in & 0x08) || (in & 0x20))))
+      out |= 0x08;
+    if (in & 0x80) out |= 0x02;
+    if (in & 0x20) out |= 0x20;
+    if ((in & 0x10) && ((in & 0x08) || (in & 0x20))) out |= 0x04;
+    if (!(in & 0x20)) out |= 0x10;
+    sink8 = out;
+  }
+}
+
+void kernelLogicLut()
+{
+  for (volatile uint16_t i = 0; i < lightIterations; i++)
+    sink8 = pgm_read_byte(&logicLut[source8]);
+}
+
+char hexFrame[10] = "1A2B3C4D5";
+
+void kernelSscanf()
+{
+  int r, g, b;
+  for (volatile uint16_t i = 0; i < heavyIterations; i++)
+  {
+    sscanf(hexFrame, "%3x%3x%3x", &r, &g, &b);
+    sinkInt = r + g + b;
+  }
+}
+
+void kernelParseHex3()
+{
+  for (volatile uint16_t i = 0; i < heavyIterations; i++)
+    sinkInt = parseHex3(hexFrame) + parseHex3(hexFrame + 3) +
+              parseHex3(hexFrame + 6);
+}
+
+char decimalBuffer[32];
+
+void kernelSprintf()
+{
+  for (volatile uint16_t i = 0; i < heavyIterations; i++)
+    sprintf(decimalBuffer, "R%4.4d G%4.4d B%4.4d", 1234, 567, 89);
+}
+
+void kernelPutDecimal4()
+{
+  for (volatile uint16_t i = 0; i < heavyIterations; i++)
+  {
+    unsigned int value = 1234;
+    char * p = decimalBuffer;
+    p[3] = '0' + value % 10;
+    value /= 10;
+    p[2] = '0' + value % 10;
+    value /= 10;
+    p[1] = '0' + value % 10;
+    p[0] = '0' + value / 10;
+    sink8 = p[0];
+  }
+}
+
+// -----[ Driver ]----------------------------------------------------------
+
+void runAll()
+{
+  lightOverhead = measure(emptyLight);
+  heavyOverhead = measure(emptyHeavy);
+
+  Serial.println(F("--- cycles per operation, loop overhead subtracted ---"));
+  report(F("digitalWrite       "), kernelDigitalWrite, lightOverhead, lightIterations);
+  report(F("FastPin toggle     "), kernelFastPin, lightOverhead, lightIterations);
+  report(F("digitalRead        "), kernelDigitalRead, lightOverhead, lightIterations);
+  report(F("packed port read   "), kernelPortRead, lightOverhead, lightIterations);
+  report(F("logic expressions  "), kernelLogicExpression, lightOverhead, lightIterations);
+  report(F("logic PROGMEM LUT  "), kernelLogicLut, lightOverhead, lightIterations);
+  report(F("sscanf %3x%3x%3x   "), kernelSscanf, heavyOverhead, heavyIterations);
+  report(F("parseHex3 x3       "), kernelParseHex3, heavyOverhead, heavyIterations);
+  report(F("sprintf 3 channels "), kernelSprintf, heavyOverhead, heavyIterations);
+  report(F("putDecimal4        "), kernelPutDecimal4, heavyOverhead, heavyIterations);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+
+  pinMode(outPin, OUTPUT);
+  pinMode(inPin, INPUT);
+
+  // Timer1 free running at the CPU clock is the stopwatch.
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  TIMSK1 = 0;
+
+  runAll();
+}
+
+void loop()
+{
+  // Any serial byte reruns the suite.
+  if (Serial.available())
+  {
+    Serial.read();
+    runAll();
+  }
+}
@@ -4,102 +4,1037 @@
  * This program drives the Parallax ColorPAL color sensor and provides
  * serial RGB data to the PC-hosted TCS230_ColorPAL_match.exe color
  * matching program.
+ *
+ * It services up to four ColorPALs from one board: each sensor owns a
+ * OneWireUart, a frame parser and a filter pipeline, and a round robin
+ * scheduler interleaves their non-blocking receive work so every
+ * sensor runs at full rate.
  */
 
-#include <SoftwareSerial.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <EEPROM.h>
+#include <FastPin.h>
+#include <Pipeline.h>
+#include <PolledTask.h>
+
+#include "OneWireUart.h"
+
+// Set to 0 to compile out the frame timing instrumentation.
+#define COLORPAL_PROFILING 1
 
 // I/O Pin definitions.
-const int sio = 2;
-const int unused = 255; // non-existant pin value
 const int sioBaud = 4800;
 
-// Received RGB values from ColorPAL.
-int red;
-int grn;
-int blu;
+// -----[ Calibration record ]------------------------------------------------
+// ColorPAL readings drift with illumination and vary unit to unit, and
+// the correction used to live on the host. It now runs here: select a
+// sensor with '0'..'3', aim it at a black reference and send 'k', then
+// at a white reference and send 'w'. That captures a per channel
+// offset and a Q8.8 scale factor, persists them to a per sensor EEPROM
+// slot, and from then on every parsed sample is corrected with one
+// subtract, one multiply and one shift per channel — integer only, and
+// loaded at power-on so a calibrated unit is calibrated from the first
+// sample.
+
+struct Calibration
+{
+  uint8_t magic;            // calMagic when the record is valid
+  int black[3];             // per channel dark offsets
+  unsigned int scale[3];    // Q8.8 gain to stretch black..white to full scale
+};
+
+const uint8_t calMagic = 0xC5;
+const int fullScale = 0x0FFF;
+
+// -----[ Per sensor state ]--------------------------------------------------
+// Everything one ColorPAL needs: its wire, its parser, its filter
+// accumulators and its calibration. The sensors array is the single
+// place to say what is wired where — port D pins only, up to four.
+
+struct ColorPalSensor
+{
+  OneWireUart uart;
 
-// Set up two software serials on the same pin.
-// This mimic PBASIC's serin and serout function.
-SoftwareSerial serin(sio, unused);
-SoftwareSerial serout(unused, sio);
+  // Frame parser state, kept across loop() passes so a partial frame
+  // just picks up where it left off when more bytes arrive.
+  char frameBuffer[10];
+  uint8_t frameIndex;
+  bool frameInSync;
+
+  // Most recent RGB values.
+  int red;
+  int grn;
+  int blu;
+
+  // The same sample before calibration touched it; the references for
+  // a new calibration must come from raw space.
+  int rawRed;
+  int rawGrn;
+  int rawBlu;
+
+  // Filter state.
+  int emaRed, emaGrn, emaBlu;
+  unsigned int boxRed, boxGrn, boxBlu;
+  uint8_t boxCount;
+  uint8_t emitCountdown;
+
+  Calibration cal;
+  bool calValid;
+
+  // Watchdog: millis() when the last good frame completed.
+  unsigned long lastFrameMillis;
+
+  // micros() of the last good frame, for the interval histogram.
+  unsigned long lastFrameMicros;
+
+  uint8_t sioPin;
+
+  ColorPalSensor(uint8_t pin)
+    : uart(pin),
+      frameIndex(0),
+      frameInSync(false),
+      red(0), grn(0), blu(0),
+      rawRed(0), rawGrn(0), rawBlu(0),
+      emaRed(0), emaGrn(0), emaBlu(0),
+      boxRed(0), boxGrn(0), boxBlu(0),
+      boxCount(0),
+      emitCountdown(1),
+      calValid(false),
+      lastFrameMillis(0),
+      lastFrameMicros(0),
+      sioPin(pin)
+  {
+  }
+};
+
+ColorPalSensor sensors[] =
+{
+  ColorPalSensor(2),
+  // Add more stations here, e.g. ColorPalSensor(3),
+};
+
+const uint8_t sensorCount = sizeof(sensors) / sizeof(sensors[0]);
+
+// Which sensor the calibration commands apply to.
+uint8_t selectedSensor = 0;
+
+// -----[ Error recovery ]----------------------------------------------------
+// A framing slip — a dropped byte or a stray '$' — costs nothing: the
+// parser just resynchronizes on the next sync mark. A genuinely wedged
+// sensor is a different animal, detected by this watchdog when no good
+// frame has completed for a whole second, and only then is the
+// expensive break-and-reprogram sequence (90+ ms of delays) rerun for
+// that one sensor.
+
+const unsigned long frameTimeoutMillis = 1000;
+
+void checkWatchdog(ColorPalSensor & s)
+{
+  if (millis() - s.lastFrameMillis < frameTimeoutMillis)
+    return;
+
+  sensorBegin(s);
+  s.lastFrameMillis = millis();
+}
+
+// Sweep every sensor; runs as a polled task, there's no need to check
+// more often than a fraction of the timeout.
+void checkWatchdogs()
+{
+  for (uint8_t i = 0; i < sensorCount; i++)
+    checkWatchdog(sensors[i]);
+}
+
+// The sketch's periodic work, pumped from loop() with no delays.
+PolledTask tasks[] =
+{
+  { checkWatchdogs, 100, 0 },
+};
+
+const uint8_t taskCount = sizeof(tasks) / sizeof(tasks[0]);
 
 // -----[ Initialization ]--------------------------------------------------
+
+// reset: Sends a long break to reset a ColorPAL and enter direct
+// command mode. Rare (setup and wedge recovery only), so plain digital
+// I/O is fine here. Returns false if the sensor never pulls the line
+// high — a dead or shorted sensor must not hang the other stations,
+// the watchdog just retries next period.
+bool reset(uint8_t pin)
+{
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);  // Pull sio low to eliminate any residual charge.
+  pinMode(pin, INPUT);     // Return pin to input.
+
+  // Wait for pin to be pulled high by ColorPAL, within reason.
+  MillisDeadline pullup(100);
+  while (digitalRead(pin) != HIGH)
+  {
+    if (pullup.expired())
+      return false;
+  }
+
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);  // Pull pin low.
+  delay(80);               // Keep low for 80ms to enter Direct mode.
+  pinMode(pin, INPUT);     // Return pin to input.
+  delay(10);               // Pause another 10ms
+  return true;
+}
+
 void setup()
 {
   // initialize serial communication:
   Serial.begin(9600);
-  
-  // Reset the ColorPAL and enter direct command mode.
-  reset();
-  
-  // Program ColorPAL to send $ then color data.
-  serout.begin(sioBaud);
-  pinMode(sio, OUTPUT);
-  serout.print("= (00 $ m) !"); // buffer commmands, loop print $ and data end_loop now execute
-  // serout is unused from this point forwards
-  serout.end();
-
-  // Now turn the sio pin into an input to read data from the color pal.
-  serin.begin(sioBaud);
-  pinMode(sio, INPUT);
+
+  // Derive the palette's hues once for the hue matcher.
+  hueMatchInit();
+
+  for (uint8_t i = 0; i < sensorCount; i++)
+  {
+    // Pick up any calibration stored from a previous session.
+    calLoad(sensors[i], i);
+
+    sensorBegin(sensors[i]);
+    sensors[i].lastFrameMillis = millis();
+  }
+}
+
+// Reset one ColorPAL and program it to stream color data. Used at
+// startup and again by the watchdog if the sensor wedges.
+void sensorBegin(ColorPalSensor & s)
+{
+  // Reset the ColorPAL and enter direct command mode. If it won't
+  // even release the line there is nothing to program yet.
+  if (!reset(s.sioPin))
+    return;
+
+  // Program ColorPAL to send $ then color data. The UART hands the
+  // pin back to its receiver as soon as the command is out.
+  s.uart.begin(sioBaud);
+  s.uart.print("= (00 $ m) !"); // buffer commmands, loop print $ and data end_loop now execute
+  s.frameInSync = false;
 }
 
 // -----[ Program Code ]----------------------------------------------------
-// SERIN sio, baud, [WAIT("$"), HEX3 red, HEX3 grn, HEX3 blu] ' Receive RGB data back.
+// The scheduler gives each sensor one service turn per loop pass; all
+// the per sensor work is non-blocking, so a busy sensor can't starve
+// the others.
 void loop()
 {
-  readData();
-}  
+  static uint8_t turn = 0;
+
+  processSerial();
+  runTasks(tasks, taskCount);
+  readData(sensors[turn]);
+  turn = (turn + 1 < sensorCount) ? turn + 1 : 0;
+  txDrain();
+  sleepIdle();
+}
+
+// -----[ Idle governor ]---------------------------------------------------
+// With every blocking wait gone the loop spins flat out doing nothing
+// between frames, which on the portable stations is most of the power
+// budget. When no work is pending the CPU now drops into SLEEP_MODE_IDLE
+// instead: the sensor pin change, the host UART, the Timer2 bit tick
+// and the millis tick all keep running and any of them wakes the core,
+// so nothing is handled later than before — the worst case is waking a
+// millisecond early on a Timer0 overflow with nothing to do. Interrupts
+// are held off between the pending-work check and sleep_cpu so an event
+// can't slip into that gap and be slept on.
+
+#if COLORPAL_PROFILING
+// Counts idle entries, declared here so the sketch compiles — globals
+// aren't hoisted the way function prototypes are. Reported and reset
+// with the frame stats in the instrumentation section.
+unsigned long statSleeps;
+#endif
+
+void sleepIdle()
+{
+  noInterrupts();
+
+  bool pending = Serial.available() != 0;
+  for (uint8_t i = 0; !pending && i < sensorCount; i++)
+    pending = sensors[i].uart.available() != 0;
+
+  if (pending)
+  {
+    interrupts();
+    return;
+  }
+
+#if COLORPAL_PROFILING
+  statSleeps++;
+#endif
+
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+}
 
 // -----[ Subroutines ]-----------------------------------------------------
 
-// reset: Sends a long break to reset ColorPAL and enter direct command mode.
-void reset()
+// Feed buffered bytes through the frame state machine one at a time.
+// A '$' always starts a fresh frame, so a truncated or garbled frame
+// costs nothing but its own bytes, and the parser never blocks waiting
+// for the sensor.
+void readData(ColorPalSensor & s)
 {
-  pinMode(sio, OUTPUT);
-  digitalWrite(sio, LOW);  // Pull sio low to eliminate any residual charge.
-  pinMode(sio, INPUT);     // Return pin to input.
-  while (digitalRead(sio) != HIGH); // Wait for pin to be pulled high by ColorPAL.
-  pinMode(sio, OUTPUT);
-  digitalWrite(sio, LOW);  // Pull pin low.
-  delay(80);               // Keep low for 80ms to enter Direct mode.
-  pinMode(sio, INPUT);     // Return pin to input.
-  delay(10);               // Pause another 10ms
+  int c;
+  while ((c = s.uart.read()) >= 0)
+  {
+    if (c == '$')
+    {
+      // Sync mark: start collecting a frame from scratch.
+      s.frameInSync = true;
+      s.frameIndex = 0;
+      continue;
+    }
+
+    if (!s.frameInSync)
+      continue;
+
+    s.frameBuffer[s.frameIndex++] = c;
+    if (s.frameIndex == 9)
+    {
+      // Three 3 digit hex numbers in hand.
+      s.frameBuffer[9] = '\0';
+      s.lastFrameMillis = millis();
+#if COLORPAL_PROFILING
+      statsFrame(s);
+#endif
+      parseFrame(s);
+      s.frameInSync = false;
+    }
+  }
+}
+
+// -----[ Formatting kernels ]----------------------------------------------
+// sscanf and sprintf drag in kilobytes of vararg formatting code and
+// cost thousands of cycles per frame. The sensor only ever sends 3
+// digit hex and the host only ever wants 4 digit decimal, so two tiny
+// fixed function routines do the job in a few hundred cycles. The hex
+// digits go through a 256 entry PROGMEM table: one fetch per digit,
+// 0xFF marks anything that isn't a hex digit.
+
+const uint8_t hexTable[256] PROGMEM =
+{
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+// Parse three hex digits into 0..4095, or -1 if any digit is bad.
+int parseHex3(const char * p)
+{
+  uint8_t hi = pgm_read_byte(&hexTable[(uint8_t)p[0]]);
+  uint8_t mid = pgm_read_byte(&hexTable[(uint8_t)p[1]]);
+  uint8_t lo = pgm_read_byte(&hexTable[(uint8_t)p[2]]);
+
+  if ((hi | mid | lo) & 0xF0)
+    return -1;
+
+  return ((int)hi << 8) | ((int)mid << 4) | lo;
+}
+
+// Emit a value 0..9999 as four zero padded decimal digits.
+void putDecimal4(char * p, unsigned int value)
+{
+  p[3] = '0' + value % 10;
+  value /= 10;
+  p[2] = '0' + value % 10;
+  value /= 10;
+  p[1] = '0' + value % 10;
+  p[0] = '0' + value / 10;
+}
+
+void parseFrame(ColorPalSensor & s)
+{
+  // parse the hex data into integers, dropping garbled frames.
+  int r = parseHex3(s.frameBuffer);
+  int g = parseHex3(s.frameBuffer + 3);
+  int b = parseHex3(s.frameBuffer + 6);
+  if (r < 0 || g < 0 || b < 0)
+    return;
+  s.red = s.rawRed = r;
+  s.grn = s.rawGrn = g;
+  s.blu = s.rawBlu = b;
+
+  // Correct for illumination and sensor variance when calibrated.
+  if (s.calValid)
+  {
+    s.red = calApply(s, s.red, 0);
+    s.grn = calApply(s, s.grn, 1);
+    s.blu = calApply(s, s.blu, 2);
+  }
+
+  filterSample(s);
+}
+
+// -----[ Sample filter ]-----------------------------------------------------
+// The PC used to average raw frames after shipping every one of them
+// over serial. The averaging now happens here, in integer math, in
+// cycles the AVR used to spend busy-waiting. Two filters are on offer:
+// an exponential moving average in Q12.3 fixed point (alpha = 1/2^k,
+// so the update is a subtract and a shift per channel) or an N sample
+// boxcar. One filtered sample goes out every emitEvery frames, which
+// cuts the serial traffic by that same factor.
+
+enum FilterMode { FILTER_NONE, FILTER_EMA, FILTER_BOXCAR };
+
+const FilterMode filterMode = FILTER_EMA;
+const uint8_t emaShift = 3;        // alpha = 1/8
+const uint8_t boxcarSamples = 8;
+const uint8_t emitEvery = 8;       // output one sample per N frames
+
+void filterSample(ColorPalSensor & s)
+{
+  int outRed = s.red;
+  int outGrn = s.grn;
+  int outBlu = s.blu;
+
+  switch (filterMode)
+  {
+    case FILTER_EMA:
+      // The accumulators hold the value shifted left three bits so the
+      // shift-down in the update doesn't throw precision away; 4095 << 3
+      // still fits a signed 16 bit int.
+      s.emaRed += ((s.red << 3) - s.emaRed) >> emaShift;
+      s.emaGrn += ((s.grn << 3) - s.emaGrn) >> emaShift;
+      s.emaBlu += ((s.blu << 3) - s.emaBlu) >> emaShift;
+      outRed = s.emaRed >> 3;
+      outGrn = s.emaGrn >> 3;
+      outBlu = s.emaBlu >> 3;
+      break;
+
+    case FILTER_BOXCAR:
+      s.boxRed += s.red;
+      s.boxGrn += s.grn;
+      s.boxBlu += s.blu;
+      if (++s.boxCount < boxcarSamples)
+        break;
+      outRed = s.boxRed / boxcarSamples;
+      outGrn = s.boxGrn / boxcarSamples;
+      outBlu = s.boxBlu / boxcarSamples;
+      s.boxRed = s.boxGrn = s.boxBlu = 0;
+      s.boxCount = 0;
+      break;
+
+    case FILTER_NONE:
+      break;
+  }
+
+  // Pace the output to every Nth input frame.
+  if (--s.emitCountdown != 0)
+    return;
+  s.emitCountdown = emitEvery;
+
+  s.red = outRed;
+  s.grn = outGrn;
+  s.blu = outBlu;
+  emitSample(s);
+}
+
+// -----[ Calibration ]-------------------------------------------------------
+
+// Each sensor gets its own EEPROM slot.
+int calAddress(uint8_t id)
+{
+  return id * (int)sizeof(Calibration);
+}
+
+void calLoad(ColorPalSensor & s, uint8_t id)
+{
+  EEPROM.get(calAddress(id), s.cal);
+  s.calValid = (s.cal.magic == calMagic);
+}
+
+// Capture the dark reference from the last raw sample. Raw, not the
+// corrected channels: on an already calibrated sensor those are in
+// corrected space, and mixing a corrected black with a raw white
+// would derive garbage gains on every recalibration.
+void calCaptureBlack(ColorPalSensor & s)
+{
+  s.cal.black[0] = s.rawRed;
+  s.cal.black[1] = s.rawGrn;
+  s.cal.black[2] = s.rawBlu;
+  s.calValid = false;  // black alone isn't a calibration yet
+}
+
+// Capture the white reference, derive the gains and persist.
+void calCaptureWhite(ColorPalSensor & s, uint8_t id)
+{
+  int white[3] = { s.rawRed, s.rawGrn, s.rawBlu };
+
+  for (uint8_t ch = 0; ch < 3; ch++)
+  {
+    int span = white[ch] - s.cal.black[ch];
+    if (span <= 0)
+      return;  // nonsense references; keep the old calibration
+    s.cal.scale[ch] = ((unsigned long)fullScale << 8) / span;
+  }
+
+  s.cal.magic = calMagic;
+  EEPROM.put(calAddress(id), s.cal);
+  s.calValid = true;
+}
+
+// Stretch a raw channel reading to full scale, clamped to 12 bits.
+int calApply(ColorPalSensor & s, int raw, uint8_t ch)
+{
+  long corrected = ((long)(raw - s.cal.black[ch]) * s.cal.scale[ch]) >> 8;
+  if (corrected < 0)
+    return 0;
+  if (corrected > fullScale)
+    return fullScale;
+  return (int)corrected;
+}
+
+// -----[ Color matcher ]-----------------------------------------------------
+// Classification is the whole point of this rig, and it used to take a
+// serial round trip to TCS230_ColorPAL_match.exe. The reference colors
+// now live in PROGMEM and each filtered sample can be matched on the
+// spot with integer squared distance — nearest neighbor with an early
+// out once a candidate exceeds the best so far, sub millisecond on a
+// 328P. Send 'M' to emit just the matched palette index per sample
+// (one byte in binary mode, a decimal line in ASCII mode) and 'm' to
+// go back to RGB output. Channel values are the sensor's 12 bit scale.
+
+struct PaletteEntry
+{
+  unsigned int r;
+  unsigned int g;
+  unsigned int b;
+};
+
+const PaletteEntry palette[] PROGMEM =
+{
+  { 0x000, 0x000, 0x000 },  // 0: black
+  { 0xFFF, 0xFFF, 0xFFF },  // 1: white
+  { 0xD00, 0x200, 0x200 },  // 2: red
+  { 0x200, 0xB00, 0x300 },  // 3: green
+  { 0x100, 0x200, 0xC00 },  // 4: blue
+  { 0xE00, 0xD00, 0x200 },  // 5: yellow
+  { 0x200, 0xB00, 0xB00 },  // 6: cyan
+  { 0xC00, 0x200, 0xA00 },  // 7: magenta
+};
+
+const uint8_t paletteSize = sizeof(palette) / sizeof(palette[0]);
+
+bool matchMode = false;
+
+// Return the index of the palette entry nearest the given color.
+uint8_t matchColor(int r, int g, int b)
+{
+  uint8_t best = 0;
+  unsigned long bestDist = 0xFFFFFFFFUL;
+
+  for (uint8_t i = 0; i < paletteSize; i++)
+  {
+    long d = (long)r - (int)pgm_read_word(&palette[i].r);
+    unsigned long dist = (unsigned long)(d * d);
+    if (dist >= bestDist)
+      continue;  // early out, red alone already loses
+
+    d = (long)g - (int)pgm_read_word(&palette[i].g);
+    dist += (unsigned long)(d * d);
+    if (dist >= bestDist)
+      continue;
+
+    d = (long)b - (int)pgm_read_word(&palette[i].b);
+    dist += (unsigned long)(d * d);
+    if (dist < bestDist)
+    {
+      bestDist = dist;
+      best = i;
+    }
+  }
+
+  return best;
 }
 
-void readData()
+
+// -----[ HSV conversion ]----------------------------------------------------
+// Matching in raw RGB is brightness sensitive: the same chip under
+// half the light moves all three channels at once and the sample
+// drifts toward black. Hue is nearly invariant under illumination, so
+// the matcher can classify on it instead — send 'H' for hue matching,
+// 'M' for the plain RGB matcher, 'm' for raw output. The conversion is
+// pure integer: the two divisions (saturation by max, hue by chroma)
+// each become one PROGMEM reciprocal fetch plus a multiply and shift,
+// a few microseconds per sample on a 328P. Hue lands on the usual byte
+// wheel (red 0, green 85, blue 171), saturation and value are 0-255.
+
+#define RECIP(d) ((uint16_t)((d) <= 1 ? 65535UL : 65536UL / (d)))
+#define RECIP_ROW(i) RECIP(i+0), RECIP(i+1), RECIP(i+2), RECIP(i+3), \
+                     RECIP(i+4), RECIP(i+5), RECIP(i+6), RECIP(i+7)
+
+const uint16_t recipTable[256] PROGMEM =
+{
+  RECIP_ROW(0x00),
+  RECIP_ROW(0x08),
+  RECIP_ROW(0x10),
+  RECIP_ROW(0x18),
+  RECIP_ROW(0x20),
+  RECIP_ROW(0x28),
+  RECIP_ROW(0x30),
+  RECIP_ROW(0x38),
+  RECIP_ROW(0x40),
+  RECIP_ROW(0x48),
+  RECIP_ROW(0x50),
+  RECIP_ROW(0x58),
+  RECIP_ROW(0x60),
+  RECIP_ROW(0x68),
+  RECIP_ROW(0x70),
+  RECIP_ROW(0x78),
+  RECIP_ROW(0x80),
+  RECIP_ROW(0x88),
+  RECIP_ROW(0x90),
+  RECIP_ROW(0x98),
+  RECIP_ROW(0xA0),
+  RECIP_ROW(0xA8),
+  RECIP_ROW(0xB0),
+  RECIP_ROW(0xB8),
+  RECIP_ROW(0xC0),
+  RECIP_ROW(0xC8),
+  RECIP_ROW(0xD0),
+  RECIP_ROW(0xD8),
+  RECIP_ROW(0xE0),
+  RECIP_ROW(0xE8),
+  RECIP_ROW(0xF0),
+  RECIP_ROW(0xF8),
+};
+
+// num / den through the reciprocal table; den must be 1-255 and the
+// result fit a byte. At most one count low, which is below the
+// sensor's own noise floor.
+uint8_t recipDiv(uint16_t num, uint8_t den)
+{
+  return (uint8_t)(((unsigned long)num * pgm_read_word(&recipTable[den])) >> 16);
+}
+
+void rgbToHsv(int r, int g, int b, uint8_t & hue, uint8_t & sat, uint8_t & val)
 {
-  char buffer[32];
-  
-  if (serin.available() > 0)
+  int mx = r > g ? r : g;
+  if (b > mx)
+    mx = b;
+  int mn = r < g ? r : g;
+  if (b < mn)
+    mn = b;
+  int chroma = mx - mn;
+
+  val = (uint8_t)(mx >> 4);  // 12 bit channel down to 8
+
+  if (chroma == 0)
+  {
+    hue = 0;
+    sat = 0;
+    return;
+  }
+
+  // The table only covers byte divisors, so shift each divisor (and
+  // its numerator with it) down until it fits; the ratio is unchanged.
+  uint8_t mshift = 0;
+  while ((mx >> mshift) > 255)
+    mshift++;
+  sat = recipDiv((uint16_t)(chroma >> mshift) * 255U, (uint8_t)(mx >> mshift));
+
+  uint8_t cshift = 0;
+  while ((chroma >> cshift) > 255)
+    cshift++;
+  uint8_t c8 = (uint8_t)(chroma >> cshift);
+
+  // Pick the sextant from the dominant channel, then offset by up to
+  // 43 (a sixth of the wheel) either way within it.
+  int num;
+  uint8_t base;
+  if (mx == r)
   {
-    // Wait for a $ and then read three 3 digit hex numbers
-    buffer[0] = serin.read();
-    if (buffer[0] == '$')
+    num = g - b;
+    base = 0;
+  }
+  else if (mx == g)
+  {
+    num = b - r;
+    base = 85;
+  }
+  else
+  {
+    num = r - g;
+    base = 171;
+  }
+
+  int mag = num < 0 ? -num : num;
+  uint8_t sixth = recipDiv((uint16_t)(43U * (unsigned int)(mag >> cshift)), c8);
+  hue = num < 0 ? (uint8_t)(base - sixth) : (uint8_t)(base + sixth);
+}
+
+// Palette hues, derived from the RGB palette at startup so the
+// reference colors have a single source of truth.
+uint8_t paletteHue[paletteSize];
+uint8_t paletteSat[paletteSize];
+
+bool hueMode = false;
+
+void hueMatchInit()
+{
+  for (uint8_t i = 0; i < paletteSize; i++)
+  {
+    int r = (int)pgm_read_word(&palette[i].r);
+    int g = (int)pgm_read_word(&palette[i].g);
+    int b = (int)pgm_read_word(&palette[i].b);
+    uint8_t val;
+    rgbToHsv(r, g, b, paletteHue[i], paletteSat[i], val);
+  }
+}
+
+// Nearest palette entry by distance around the hue wheel. Achromatic
+// samples carry no usable hue, so low saturation falls back to black
+// or white on value alone — and the achromatic palette entries sit
+// out the hue comparison for the same reason.
+uint8_t matchHue(int r, int g, int b)
+{
+  uint8_t hue, sat, val;
+  rgbToHsv(r, g, b, hue, sat, val);
+
+  if (sat < 32)
+    return val < 128 ? 0 : 1;  // black : white
+
+  uint8_t best = 0;
+  uint8_t bestDist = 255;
+  for (uint8_t i = 0; i < paletteSize; i++)
+  {
+    if (paletteSat[i] < 32)
+      continue;
+    uint8_t d = (uint8_t)(hue - paletteHue[i]);
+    if (d > 128)
+      d = (uint8_t)(0 - d);
+    if (d < bestDist)
     {
-      for(int i = 0; i < 9; i++)
-      {
-        // Wait for the next input character.
-        while (serin.available() == 0);     
-        buffer[i] = serin.read();
+      bestDist = d;
+      best = i;
+    }
+  }
+  return best;
+}
+
+// -----[ Output stage ]----------------------------------------------------
+// Serial.write blocks the moment the 64 byte HardwareSerial buffer
+// fills, which stalls the sketch on output exactly when it should be
+// sampling the next frame. Samples are now staged into a larger
+// application side PipeQueue and drained a batch at a time, never more
+// than Serial.availableForWrite() bytes, so the UART interrupt
+// transmits one batch while the loop accumulates the next and nothing
+// blocks. A sample that doesn't fit whole is dropped and counted
+// rather than smeared across a stall; 'j' reports the drop count.
+
+PipeQueue<uint8_t, 128> txQueue;
+unsigned int txDropped;  // whole samples dropped for lack of space
 
-        // every so often the data terminates early.  If this happens return
-        if (buffer[i] == '$')
-          return;
+void txWrite(const uint8_t * data, uint8_t length)
+{
+  while (length-- > 0)
+    txQueue.put(*data++);
+}
+
+// Move bytes to the hardware only while it has room; returns at once.
+void txDrain()
+{
+  uint8_t room = Serial.availableForWrite();
+  uint8_t b;
+  while (room-- > 0 && txQueue.take(b))
+    Serial.write(b);
+}
+
+// Drain to empty. Only for the rare human paced paths (command
+// replies, baud switches) where ordering matters more than latency.
+void txFlush()
+{
+  while (!txQueue.empty())
+    txDrain();
+}
+
+// -----[ Instrumentation ]---------------------------------------------------
+// The old blocking reads made frame timing unobservable; now it can be
+// measured without perturbing it. With COLORPAL_PROFILING enabled each
+// completed frame costs a handful of integer updates: min/max/sum of
+// the inter frame interval plus one histogram bucket increment, in
+// power of two buckets from 2 ms up. Send 'j' for a report (and to
+// restart the window), and 'T'/'t' to tag each emitted sample with a
+// micros() timestamp — appended as four raw bytes in binary mode, a
+// " T<micros>" suffix in ASCII.
+
+bool timestampMode = false;
+
+#if COLORPAL_PROFILING
+const uint8_t statBuckets = 8;  // <2ms, <4ms, ... <128ms, rest in the last
+
+unsigned long statFrames;
+unsigned long statMinMicros;
+unsigned long statMaxMicros;
+unsigned long statSumMicros;
+unsigned long statHistogram[statBuckets];
+
+void statsReset()
+{
+  statFrames = 0;
+  statSleeps = 0;
+  statMinMicros = 0xFFFFFFFFUL;
+  statMaxMicros = 0;
+  statSumMicros = 0;
+  for (uint8_t i = 0; i < statBuckets; i++)
+    statHistogram[i] = 0;
+}
+
+// Record one completed frame's distance from the previous one.
+void statsFrame(ColorPalSensor & s)
+{
+  unsigned long now = micros();
+  if (s.lastFrameMicros == 0)
+  {
+    s.lastFrameMicros = now;
+    return;  // first frame has no interval yet
+  }
+  unsigned long delta = now - s.lastFrameMicros;
+  s.lastFrameMicros = now;
+
+  statFrames++;
+  statSumMicros += delta;
+  if (delta < statMinMicros)
+    statMinMicros = delta;
+  if (delta > statMaxMicros)
+    statMaxMicros = delta;
+
+  uint8_t bucket = 0;
+  unsigned long limit = 2000;
+  while (bucket < statBuckets - 1 && delta >= limit)
+  {
+    bucket++;
+    limit <<= 1;
+  }
+  statHistogram[bucket]++;
+}
+
+void statsReport()
+{
+  if (statFrames == 0)
+    return;
+
+  Serial.print(F("frames: "));
+  Serial.println(statFrames);
+  Serial.print(F("interval us min/mean/max: "));
+  Serial.print(statMinMicros);
+  Serial.print('/');
+  Serial.print(statSumMicros / statFrames);
+  Serial.print('/');
+  Serial.println(statMaxMicros);
+  Serial.print(F("idle sleeps: "));
+  Serial.println(statSleeps);
+  Serial.print(F("tx dropped: "));
+  Serial.println(txDropped);
+  Serial.print(F("histogram:"));
+  for (uint8_t i = 0; i < statBuckets; i++)
+  {
+    Serial.print(' ');
+    Serial.print(statHistogram[i]);
+  }
+  Serial.println();
+
+  statsReset();
+}
+#endif
+
+// -----[ Host link ]-------------------------------------------------------
+// The ASCII lines are 20 bytes per sample, which caps the sample rate
+// the host sees at 9600 baud. Sending 'B' switches the link to a seven
+// byte binary frame at 115200 baud: a sync byte, the sensor id, the
+// three 12 bit channels packed big endian into four and a half bytes,
+// and a 4 bit XOR checksum of the id and data nibbles in the low
+// nibble of the last byte. 'A' returns to ASCII at 9600, which stays
+// the default so TCS230_ColorPAL_match.exe keeps working out of the
+// box; with more than one sensor wired the ASCII lines gain an "Sn "
+// tag so the host can tell the stations apart.
+
+const uint8_t binarySync = 0xA5;
+
+const unsigned long asciiBaud = 9600;
+const unsigned long binaryBaud = 115200;
+
+bool binaryMode = false;
+
+// Build the whole message for one sample in a local buffer, then stage
+// it into the output ring in one piece (or drop it in one piece).
+void emitSample(ColorPalSensor & s)
+{
+  uint8_t id = (uint8_t)(&s - sensors);
+  uint8_t msg[40];
+  uint8_t * p = msg;
+
+  if (matchMode)
+  {
+    uint8_t index = hueMode ? matchHue(s.red, s.grn, s.blu)
+                            : matchColor(s.red, s.grn, s.blu);
+    if (binaryMode)
+    {
+      *p++ = id;
+      *p++ = index;
+    }
+    else
+    {
+      if (sensorCount > 1)
+      {
+        *p++ = 'S';
+        *p++ = '0' + id;
+        *p++ = ' ';
       }
-      parseAndPrint(buffer);
-      delay(10);
+      *p++ = '0' + index;
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+  }
+  else if (binaryMode)
+  {
+    uint8_t * frame = p;
+    *p++ = binarySync;
+    *p++ = id;
+    *p++ = s.red >> 4;
+    *p++ = ((s.red & 0x0F) << 4) | (s.grn >> 8);
+    *p++ = s.grn & 0xFF;
+    *p++ = s.blu >> 4;
+
+    uint8_t check = 0;
+    for (uint8_t i = 1; i < 6; i++)
+      check ^= (frame[i] >> 4) ^ frame[i];
+    check ^= s.blu & 0x0F;
+    *p++ = ((s.blu & 0x0F) << 4) | (check & 0x0F);
+
+    if (timestampMode)
+    {
+      // Four raw little endian bytes of micros().
+      unsigned long now = micros();
+      memcpy(p, &now, sizeof(now));
+      p += sizeof(now);
+    }
+  }
+  else
+  {
+    // format using the format expected by the windows program.
+    static char body[] = "R0000 G0000 B0000";
+    putDecimal4(body + 1, s.red);
+    putDecimal4(body + 7, s.grn);
+    putDecimal4(body + 13, s.blu);
+    if (sensorCount > 1)
+    {
+      *p++ = 'S';
+      *p++ = '0' + id;
+      *p++ = ' ';
+    }
+    memcpy(p, body, sizeof(body) - 1);
+    p += sizeof(body) - 1;
+    if (timestampMode)
+    {
+      *p++ = ' ';
+      *p++ = 'T';
+      ultoa(micros(), (char *)p, 10);
+      p += strlen((char *)p);
     }
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+
+  uint8_t length = (uint8_t)(p - msg);
+  if (txQueue.free() < length)
+  {
+    txDropped++;
+    return;
   }
+  txWrite(msg, length);
 }
 
-void parseAndPrint(char * data)
+// Dispatch single character commands from the host.
+void processSerial()
 {
-  // parse the hex data into integers.
-  sscanf (data, "%3x%3x%3x", &red, &grn, &blu);
+  if (Serial.available() == 0)
+    return;
+
+  int c = Serial.read();
+
+  // Commands are human paced; empty the output ring first so replies
+  // come out in order and a baud switch can't strand staged bytes.
+  txFlush();
+
+  switch (c)
+  {
+    case 'B':
+      Serial.flush();
+      Serial.begin(binaryBaud);
+      binaryMode = true;
+      break;
+
+    case 'A':
+      Serial.flush();
+      Serial.begin(asciiBaud);
+      binaryMode = false;
+      break;
+
+    case 'M':
+      matchMode = true;
+      hueMode = false;
+      break;
 
-  // format using the format expected by the windows program and output it.
-  char buffer[32];
-  sprintf(buffer, "R%4.4d G%4.4d B%4.4d", red, grn, blu);
-  Serial.println(buffer);
+    case 'H':
+      matchMode = true;
+      hueMode = true;
+      break;
+
+    case 'm':
+      matchMode = false;
+      hueMode = false;
+      break;
+
+    case 'k':
+      calCaptureBlack(sensors[selectedSensor]);
+      break;
+
+    case 'w':
+      calCaptureWhite(sensors[selectedSensor], selectedSensor);
+      break;
+
+    case 'T':
+      timestampMode = true;
+      break;
+
+    case 't':
+      timestampMode = false;
+      break;
+
+#if COLORPAL_PROFILING
+    case 'j':
+      statsReport();
+      break;
+#endif
+
+    default:
+      // '0'..'3' select which sensor the calibration commands target.
+      if (c >= '0' && c < '0' + sensorCount)
+        selectedSensor = c - '0';
+      break;
+  }
 }
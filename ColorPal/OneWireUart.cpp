@@ -0,0 +1,173 @@
+/**
+ * OneWireUart implementation. See the header for the theory of
+ * operation; the short version is that the pin change ISR spots start
+ * bits and the Timer2 compare ISR does the bit sampling at four ticks
+ * per bit, so reception costs a few percent of the CPU instead of a
+ * busy-wait.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#include "OneWireUart.h"
+
+OneWireUart * OneWireUart::_instances[OneWireUart::maxInstances];
+uint8_t OneWireUart::_instanceCount;
+
+OneWireUart::OneWireUart(uint8_t pin)
+  : _pin(pin),
+    _mask(0),
+    _state(RX_IDLE),
+    _bitMicros(0)
+{
+}
+
+void OneWireUart::begin(unsigned long baud)
+{
+  _mask = digitalPinToBitMask(_pin);
+  _bitMicros = 1000000UL / baud;
+  _state = RX_IDLE;
+
+  // The watchdog calls begin() again on every wedge recovery, so only
+  // register on the first call; a duplicate entry would run tick()
+  // twice per timer tick and garble reception for good.
+  bool registered = false;
+  for (uint8_t i = 0; i < _instanceCount; i++)
+    registered = registered || (_instances[i] == this);
+  if (!registered && _instanceCount < maxInstances)
+    _instances[_instanceCount++] = this;
+
+  pinMode(_pin, INPUT);
+
+  // The timer is shared, so the last begin()'s baud rate wins; in
+  // practice every ColorPAL runs at the same rate.
+  noInterrupts();
+
+  // Timer2 CTC at four ticks per bit.
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS21);  // prescale 8
+  OCR2A = (uint8_t)(F_CPU / 8 / (baud * 4) - 1);
+  TIMSK2 = _BV(OCIE2A);
+
+  // Watch for start bits. Port D pin numbers equal their mask bits.
+  PCMSK2 |= _mask;
+  PCICR |= _BV(PCIE2);
+
+  interrupts();
+}
+
+void OneWireUart::end()
+{
+  noInterrupts();
+  PCMSK2 &= ~_mask;
+  _state = RX_IDLE;
+  interrupts();
+}
+
+uint8_t OneWireUart::available()
+{
+  return _rx.available();
+}
+
+int OneWireUart::read()
+{
+  uint8_t b;
+  return _rx.take(b) ? b : -1;
+}
+
+void OneWireUart::write(uint8_t b)
+{
+  // Take the pin for ourselves while sending.
+  PCMSK2 &= ~_mask;
+  digitalWrite(_pin, HIGH);
+  pinMode(_pin, OUTPUT);
+
+  // Start bit.
+  digitalWrite(_pin, LOW);
+  delayMicroseconds(_bitMicros);
+
+  // Data bits, least significant first.
+  for (uint8_t bit = 0; bit < 8; bit++)
+  {
+    digitalWrite(_pin, (b >> bit) & 1);
+    delayMicroseconds(_bitMicros);
+  }
+
+  // Stop bit, then hand the pin back to the receiver.
+  digitalWrite(_pin, HIGH);
+  delayMicroseconds(_bitMicros);
+
+  pinMode(_pin, INPUT);
+  PCMSK2 |= _mask;
+}
+
+void OneWireUart::print(const char * s)
+{
+  while (*s)
+    write(*s++);
+}
+
+// A falling edge on an idle pin is a start bit. The timer phase is
+// asynchronous to the edge, so the first tick lands anywhere in the
+// next 0-0.25 bit times; six ticks puts the first data bit sample at
+// 1.25-1.5 bit times, past the middle of the bit with margin in both
+// directions. Five ticks would sample the leading quarter in the worst
+// phase, leaving no tolerance for a sensor whose clock runs slow.
+void OneWireUart::startBit()
+{
+  if (_state == RX_IDLE && (PIND & _mask) == 0)
+  {
+    _state = RX_SAMPLING;
+    _countdown = 6;
+    _bitsLeft = 8;
+    _shifter = 0;
+  }
+}
+
+// One Timer2 tick: count down to the middle of the next bit and shift
+// the sample in, least significant bit first.
+void OneWireUart::tick()
+{
+  if (_state != RX_SAMPLING)
+    return;
+
+  if (--_countdown != 0)
+    return;
+
+  _shifter >>= 1;
+  if (PIND & _mask)
+    _shifter |= 0x80;
+
+  if (--_bitsLeft == 0)
+  {
+    // Byte complete; the queue just drops it if the consumer is behind.
+    _rx.put(_shifter);
+    _state = RX_IDLE;
+  }
+  else
+  {
+    _countdown = 4;  // four ticks per bit
+  }
+}
+
+void oneWireUartPinChange()
+{
+  for (uint8_t i = 0; i < OneWireUart::_instanceCount; i++)
+    OneWireUart::_instances[i]->startBit();
+}
+
+void oneWireUartTick()
+{
+  for (uint8_t i = 0; i < OneWireUart::_instanceCount; i++)
+    OneWireUart::_instances[i]->tick();
+}
+
+ISR(PCINT2_vect)
+{
+  oneWireUartPinChange();
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  oneWireUartTick();
+}
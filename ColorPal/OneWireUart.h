@@ -0,0 +1,72 @@
+/**
+ * ** OneWireUart - interrupt driven half duplex serial on one pin **
+ * SoftwareSerial busy-waits with interrupts off for entire bit times,
+ * which burns 100% CPU while listening and blocks everything else on
+ * the board. This driver listens instead with a pin change interrupt
+ * to catch the start bit and a Timer2 tick at four times the baud rate
+ * to sample the data bits, filling a ring buffer from the ISR. The
+ * main loop polls available()/read() and stays free for real work.
+ *
+ * Transmit is a short blocking bit-bang, which is fine here because the
+ * ColorPAL only gets talked to during initialization. The same pin
+ * serves both directions: the driver parks it as an input with the
+ * interrupt armed whenever it isn't actively sending.
+ *
+ * Only port D pins (0-7) are supported, which is where the PCINT2
+ * vector lives and where the sensors get wired. Up to four instances
+ * can listen at once off the shared timer tick.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#ifndef ONEWIREUART_H
+#define ONEWIREUART_H
+
+#include <Arduino.h>
+#include <Pipeline.h>
+
+class OneWireUart
+{
+public:
+  OneWireUart(uint8_t pin);
+
+  // Start listening at the given baud rate. All instances must use the
+  // same rate since they share the Timer2 tick.
+  void begin(unsigned long baud);
+  void end();
+
+  uint8_t available();
+  int read();
+
+  // Blocking transmit; reception on this pin pauses while sending.
+  void write(uint8_t b);
+  void print(const char * s);
+
+private:
+  static const uint8_t rxBufferSize = 32;
+  static const uint8_t maxInstances = 4;
+
+  // Receive state machine, driven from the ISRs.
+  enum RxState { RX_IDLE, RX_SAMPLING };
+
+  void startBit();
+  void tick();
+
+  uint8_t _pin;
+  uint8_t _mask;                  // bit within port D
+  volatile RxState _state;
+  volatile uint8_t _countdown;    // ticks until the next bit sample
+  volatile uint8_t _bitsLeft;
+  volatile uint8_t _shifter;
+  PipeQueue<uint8_t, rxBufferSize> _rx;  // ISR produces, read() consumes
+  unsigned long _bitMicros;
+
+  static OneWireUart * _instances[maxInstances];
+  static uint8_t _instanceCount;
+
+  friend void oneWireUartPinChange();
+  friend void oneWireUartTick();
+};
+
+#endif // ONEWIREUART_H
@@ -12,7 +12,29 @@
  * Copyright (c) 2017 by Martin Heermance
  * MIT Licensed
  **/
- 
+
+#include <avr/pgmspace.h>
+#include <EEPROM.h>
+#include <FastPin.h>
+#include <Pipeline.h>
+#include <PolledTask.h>
+
+#include "ElfLogic.h"
+
+// Build option: set to 1 for a rig whose front panel is a scanned
+// switch matrix on the expansion header instead of direct-wired
+// toggles. See the switch matrix section below for the hardware.
+#define ELF_SWITCH_MATRIX 0
+
+#if ELF_SWITCH_MATRIX
+// Scanner state the ISRs and the burst loader touch before the switch
+// matrix section defines the rest: whether the loader owns the shift
+// register chain, and a mirror of the debounced LOAD key for the
+// flip flop reset in the status line ISR.
+volatile uint8_t expBusBusy;
+volatile uint8_t matrixLoadActive;
+#endif
+
 // Output pins to control ELF.
 const int clockPin = 15;
 const int clrPin = 14;
@@ -22,6 +44,15 @@ const int displayLatchPin = 11;
 const int inputLatchPin = 10;
 const int dmaInPin = 9;
 
+// Expansion pins for the burst loader's 74HC595 shift register. The
+// register sits in parallel with the data toggles (its /OE is held by
+// enablePin so it only drives the latch inputs during a burst), which
+// lets the AVR play very fast fingers on the front panel.
+const int expDataPin = 16;
+const int expClockPin = 17;
+const int expLatchPin = 18;
+const int expEnablePin = 19;
+
 // Input pins that determine machine state.
 const int inPin = 8;
 const int loadPin = 7;
@@ -31,105 +62,999 @@ const int runPin = 4;
 const int sc1Pin = 3;
 const int tpbPin = 2;
 
-void setup()
+// Port masks derived from the pin constants above. On the ATmega328
+// digital pins 0-7 live on PORTD, 8-13 on PORTB and A0-A5 (14-19) on
+// PORTC, so the inputs arrive in one PIND read (plus PB0 for the IN
+// switch) and the outputs leave in one masked PORTB and PORTC write.
+// Keep the pin constants as the single source of truth and derive
+// everything here from them.
+const uint8_t clockMask = 1 << (clockPin - 14);        // PORTC
+const uint8_t clrMask = 1 << (clrPin - 14);            // PORTC
+const uint8_t ef4Mask = 1 << (ef4Pin - 8);             // PORTB
+const uint8_t waitMask = 1 << (waitPin - 8);           // PORTB
+const uint8_t displayLatchMask = 1 << (displayLatchPin - 8);
+const uint8_t inputLatchMask = 1 << (inputLatchPin - 8);
+const uint8_t dmaInMask = 1 << (dmaInPin - 8);         // PORTB
+
+const uint8_t outPortBMask = ef4Mask | waitMask | displayLatchMask |
+                             inputLatchMask | dmaInMask;
+
+// -----[ Combinational logic lookup table ]--------------------------------
+// The output equations live in ElfLogic.h (shared with the host
+// simulator in sim/) as a constexpr function of the packed input byte,
+// and get unrolled here into a 256 entry PROGMEM table. The whole
+// output computation at runtime is then one table fetch and one port
+// write. ElfLogic.h also fixes the packed input bit layout (tpbBit
+// through notQBit) that readInputs() produces, and its output bit
+// constants line up with the port masks above by construction.
+
+#define LUT_ROW(i) elfLogicCompute(i+0), elfLogicCompute(i+1), \
+                   elfLogicCompute(i+2), elfLogicCompute(i+3), \
+                   elfLogicCompute(i+4), elfLogicCompute(i+5), \
+                   elfLogicCompute(i+6), elfLogicCompute(i+7)
+
+const uint8_t logicLut[256] PROGMEM =
 {
-  pinMode(clockPin, OUTPUT);
-  pinMode(clrPin, OUTPUT);
-  pinMode(dmaInPin, OUTPUT);
-  pinMode(waitPin, OUTPUT);
-  pinMode(displayLatchPin, OUTPUT);
-  pinMode(inputLatchPin, OUTPUT);
+  LUT_ROW(0x00), LUT_ROW(0x08), LUT_ROW(0x10), LUT_ROW(0x18),
+  LUT_ROW(0x20), LUT_ROW(0x28), LUT_ROW(0x30), LUT_ROW(0x38),
+  LUT_ROW(0x40), LUT_ROW(0x48), LUT_ROW(0x50), LUT_ROW(0x58),
+  LUT_ROW(0x60), LUT_ROW(0x68), LUT_ROW(0x70), LUT_ROW(0x78),
+  LUT_ROW(0x80), LUT_ROW(0x88), LUT_ROW(0x90), LUT_ROW(0x98),
+  LUT_ROW(0xA0), LUT_ROW(0xA8), LUT_ROW(0xB0), LUT_ROW(0xB8),
+  LUT_ROW(0xC0), LUT_ROW(0xC8), LUT_ROW(0xD0), LUT_ROW(0xD8),
+  LUT_ROW(0xE0), LUT_ROW(0xE8), LUT_ROW(0xF0), LUT_ROW(0xF8),
+};
 
-  pinMode(inPin, INPUT);
-  pinMode(loadPin, INPUT);
-  pinMode(mreadPin, INPUT);
-  pinMode(n2Pin, INPUT);
-  pinMode(runPin, INPUT);
-  pinMode(sc1Pin, INPUT);
-  pinMode(tpbPin, INPUT);
+// Sample every input pin in two port reads instead of seven calls to
+// digitalRead. The masks above index into the returned byte.
+uint8_t readInputs()
+{
+  uint8_t d = PIND;
+  uint8_t b = PINB;
+  return (d >> 2) | ((b & 0x01) << 6);
 }
 
-void loop()
+// -----[ DMA-in flip flop ]------------------------------------------------
+// The flip flop used to be clocked once per loop() pass, so the fastest
+// IN edge it could see was bounded by loop latency — at higher machine
+// clocks that drops DMA requests outright. The IN switch sits alone on
+// PB0, so its own pin change interrupt (PCINT0) now clocks the shared
+// ElfFlipFlop core within a few cycles of the edge, and the status line
+// ISR below applies the async reset the moment SC1 rises. loop() just
+// reads the mirrored notQ level. The ISR samples the raw pin, so a
+// short millis lockout stands in for the debouncer on this one input:
+// contact bounce rides inside the lockout, while any deliberate press
+// is far slower than it.
+
+ElfFlipFlop dmaFlipFlop;
+volatile uint8_t dmaNotQ = 1;  // mirror of dmaFlipFlop.notQ for loop()
+
+const unsigned long inLockoutMillis = 20;
+
+#if !ELF_SWITCH_MATRIX
+ISR(PCINT0_vect)
+{
+  static unsigned long lastChangeMillis;
+
+  uint8_t notIn = (PINB & 0x01) == 0;
+  uint8_t sc1OrNotLoad = (PIND & _BV(sc1Pin)) != 0 ||
+                         (PIND & _BV(loadPin)) == 0;
+
+  // The lockout restarts on any accepted level change, not just the
+  // clocking edge: break bounce on a release briefly re-makes contact,
+  // and if the release didn't arm the lockout that blip would present
+  // as a fresh rising edge and clock a spurious DMA request.
+  unsigned long now = millis();
+  bool locked = (now - lastChangeMillis) < inLockoutMillis;
+  if (!locked && notIn != dmaFlipFlop.priorNotIn)
+    lastChangeMillis = now;
+
+  // Within the lockout the prior level is fed back, which swallows the
+  // phantom edge from a bouncing contact without losing the reset.
+  dmaNotQ = dmaFlipFlop.update(locked ? dmaFlipFlop.priorNotIn : notIn,
+                               sc1OrNotLoad);
+}
+#endif
+
+// Single step controller state, owned by the serial commands below and
+// consulted on every output write so a halt can't be overridden.
+volatile uint8_t elfHalted;              // when set, /WAIT is forced low
+volatile unsigned int stepRemaining;     // TPB edges left in a step
+
+// Drive every output pin (except the clock, which toggles separately)
+// from a packed byte whose bits are already port aligned: bits 1-5 are
+// PORTB, bit 0 is CLR on PORTC.
+void writeOutputs(uint8_t out)
+{
+  // The whole update runs with interrupts off: the step ISR reasserts
+  // /WAIT by writing PORTB the instant stepRemaining hits zero, and a
+  // read-modify-write racing it would put /WAIT back high and let the
+  // 1802 overshoot the step. The halt check has to sit inside the same
+  // window, or a value computed while a step was still in flight could
+  // slip through after it lands. (The PORTC write rides along because
+  // the clock ISR toggles a PORTC bit through PINC.)
+  noInterrupts();
+  if (elfHalted && stepRemaining == 0)
+    out &= ~waitMask;
+  PORTB = (PORTB & ~outPortBMask) | (out & outPortBMask);
+  PORTC = (PORTC & ~clrMask) | (out & clrMask);
+  interrupts();
+}
+
+// -----[ Vertical counter debounce ]---------------------------------------
+// All eight bits of the packed input byte are debounced at once with
+// the vertical counter trick: two bit planes form a 2 bit counter per
+// input lane, and only a lane whose raw sample disagrees with its
+// debounced value for four consecutive samples gets toggled. The cost
+// is a handful of bitwise ops for the whole port, flat no matter how
+// many switches are wired up. Timer2 ticks at 1 kHz and the counter
+// advances every 16th tick, so a change must hold 48-64 ms — the same
+// ballpark as the old 50 ms per pin debounce.
+
+volatile uint8_t debouncedInputs;
+
+ISR(TIMER2_COMPA_vect)
+{
+  static uint8_t tickDivider;
+  static uint8_t plane0;
+  static uint8_t plane1;
+
+#if ELF_SWITCH_MATRIX
+  matrixScanTick();
+#endif
+
+  if (++tickDivider & 0x0F)
+    return;
+
+  uint8_t delta = readInputs() ^ debouncedInputs;
+  plane1 = (plane1 ^ plane0) & delta;
+  plane0 = ~plane0 & delta;
+
+  // Lanes whose counter just rolled over have been stable long enough.
+  debouncedInputs ^= delta & ~(plane0 | plane1);
+}
+
+void debounceBegin()
+{
+  // Seed from the switches' current positions so power-on doesn't
+  // register phantom edges.
+  debouncedInputs = readInputs();
+
+  // Timer2 CTC at 1 kHz: 16 MHz / 64 / 250.
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS22);  // prescale 64
+  OCR2A = (F_CPU / 64 / 1000) - 1;
+  TIMSK2 = _BV(OCIE2A);
+}
+
+// -----[ 1802 clock generator ]--------------------------------------------
+// The machine clock now comes from Timer1 in CTC mode instead of being
+// toggled by loop(), so its frequency is rock steady no matter what the
+// glue logic evaluation is doing. The clock pin (PC1) isn't a timer
+// output compare pin, so the compare ISR toggles it by writing its bit
+// to PINC, which the AVR treats as a one instruction toggle. That caps
+// the practical clock in the low hundreds of kHz, plenty for this rig.
+
+const unsigned long defaultClockHz = 4000;
+
+ISR(TIMER1_COMPA_vect)
+{
+  PINC = clockMask;  // toggle the clock pin
+}
+
+// Set the 1802 clock frequency, at boot and from the 'c' command.
+// Useful values run from a few kHz for single stepping by eye up to
+// the ISR toggle ceiling; zero parks the clock line low.
+void elfClockSetHz(unsigned long hz)
+{
+  if (hz == 0)
+  {
+    elfClockStop();
+    return;
+  }
+
+  // Each compare match is half a clock period.
+  unsigned long toggles = hz * 2;
+
+  // Pick the smallest prescaler that fits the count in 16 bits.
+  const unsigned int prescales[] = { 1, 8, 64, 256, 1024 };
+  const uint8_t csBits[] = { _BV(CS10), _BV(CS11), _BV(CS11) | _BV(CS10),
+                             _BV(CS12), _BV(CS12) | _BV(CS10) };
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    unsigned long top = F_CPU / prescales[i] / toggles;
+    if (top == 0)
+      top = 1;  // absurdly high hz: run flat out, don't wrap to 0xFFFF
+    if (top <= 65536UL)
+    {
+      noInterrupts();
+      TCCR1A = 0;
+      TCCR1B = _BV(WGM12) | csBits[i];  // CTC, TOP in OCR1A
+      OCR1A = (unsigned int)(top - 1);
+      TCNT1 = 0;
+      TIMSK1 = _BV(OCIE1A);
+      interrupts();
+      return;
+    }
+  }
+}
+
+// Park the clock low, e.g. while reprogramming the Elf.
+void elfClockStop()
+{
+  noInterrupts();
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  interrupts();
+  PORTC &= ~clockMask;
+}
+
+// -----[ Instrumentation ]-------------------------------------------------
+// Optional counters for tuning the clock rate. When ELF_PROFILING is 0
+// the hot path pays nothing; when 1 it pays a couple of increments and
+// compares per pass. Send 'i' over serial for a report, which also
+// resets the measurement window.
+
+#define ELF_PROFILING 1
+
+#if ELF_PROFILING
+unsigned long statIterations;
+volatile unsigned long statTpbEdges;
+unsigned long statMinMicros;
+unsigned long statMaxMicros;
+unsigned long statSumMicros;
+unsigned long statPriorMicros;
+unsigned long statWindowStart;
+
+void statsReset()
+{
+  statIterations = 0;
+  noInterrupts();
+  statTpbEdges = 0;
+  interrupts();
+  statMinMicros = 0xFFFFFFFFUL;
+  statMaxMicros = 0;
+  statSumMicros = 0;
+  statPriorMicros = micros();
+  statWindowStart = millis();
+}
+
+// Called once per loop pass to track iteration timing; TPB edges are
+// counted in the pin change ISR where none can be missed.
+void statsSample()
+{
+  unsigned long now = micros();
+  unsigned long delta = now - statPriorMicros;
+  statPriorMicros = now;
+
+  statIterations++;
+  statSumMicros += delta;
+  if (delta < statMinMicros)
+    statMinMicros = delta;
+  if (delta > statMaxMicros)
+    statMaxMicros = delta;
+}
+
+void statsReport()
+{
+  unsigned long windowMillis = millis() - statWindowStart;
+  if (windowMillis == 0 || statIterations == 0)
+    return;
+
+  noInterrupts();
+  unsigned long tpbEdges = statTpbEdges;
+  interrupts();
+
+  Serial.print(F("window ms: "));
+  Serial.println(windowMillis);
+  Serial.print(F("loop/s: "));
+  Serial.println(statIterations * 1000 / windowMillis);
+  Serial.print(F("iter us min/mean/max: "));
+  Serial.print(statMinMicros);
+  Serial.print('/');
+  Serial.print(statSumMicros / statIterations);
+  Serial.print('/');
+  Serial.println(statMaxMicros);
+  Serial.print(F("tpb edges/s: "));
+  Serial.println(tpbEdges * 1000 / windowMillis);
+
+  // TPB pulses once per machine cycle and a machine cycle is eight
+  // clocks, so this is the 1802 clock the Elf actually saw.
+  Serial.print(F("effective clock Hz: "));
+  Serial.println(tpbEdges * 1000 / windowMillis * 8);
+
+  statsReset();
+}
+#endif
+
+// -----[ Bus state trace buffer ]------------------------------------------
+// When the Elf misbehaves the LED display isn't much of a witness. The
+// pin change ISR stores the packed input byte into this ring at every
+// TPB edge — one store and one index increment, cheap enough to leave
+// on at full machine clock. Serial 'd' pauses capture and streams the
+// raw buffer oldest-first with no per-entry formatting; the host tool
+// unpacks the bits. 512 entries is 512 machine cycles of history.
+
+const unsigned int traceSize = 512;  // power of two
+const unsigned int traceMask = traceSize - 1;
+
+volatile uint8_t traceBuffer[traceSize];
+volatile unsigned int traceIndex;
+volatile uint8_t traceEnabled = 1;
+
+void traceDump()
+{
+  traceEnabled = 0;
+
+  // Oldest entry first: the ring wraps at traceIndex.
+  unsigned int start = traceIndex & traceMask;
+  Serial.write((const uint8_t *)traceBuffer + start, traceSize - start);
+  Serial.write((const uint8_t *)traceBuffer, start);
+
+  traceEnabled = 1;
+}
+
+// -----[ Status line event pipeline ]--------------------------------------
+// The 1802's status lines (TPB, SC1, /MREAD, N2) used to be polled every
+// loop pass, which wasted cycles when nothing changed and risked missing
+// short TPB pulses at higher clock rates. They now raise a pin change
+// interrupt (all four live on port D) and the ISR drops a packed input
+// snapshot into a PipeQueue: the ISR produces, loop() consumes, and
+// the capture, compute and output stages overlap instead of running
+// in lockstep.
+
+PipeQueue<uint8_t, 16> eventQueue;
+
+ISR(PCINT2_vect)
+{
+  uint8_t in = readInputs();
+
+  eventQueue.put(in);
+
+  // The flip flop's async reset arrives on these lines too: SC1 high
+  // or the load switch off forces notQ back up right here, so the 1802
+  // never sees a stale DMA request for longer than one status change.
+#if ELF_SWITCH_MATRIX
+  if ((in & sc1Bit) != 0 || !matrixLoadActive)
+#else
+  if ((in & sc1Bit) != 0 || (in & loadBit) == 0)
+#endif
+  {
+    dmaFlipFlop.notQ = 1;
+    dmaNotQ = 1;
+  }
+
+  // Detect TPB rising edges at interrupt speed.
+  static uint8_t lastTpb;
+  uint8_t tpb = in & tpbBit;
+  uint8_t tpbRose = tpb && !lastTpb;
+  lastTpb = tpb;
+
+  if (tpbRose)
+  {
+    // If a single step is in flight, count it down and reassert /WAIT
+    // right here so the step lands on exactly the requested cycle.
+    if (stepRemaining && --stepRemaining == 0)
+      PORTB &= ~waitMask;
+
+    // Trace capture: one store and one increment per machine cycle.
+    if (traceEnabled)
+      traceBuffer[traceIndex++ & traceMask] = in;
+
+#if ELF_PROFILING
+    statTpbEdges++;
+#endif
+  }
+}
+
+void eventsBegin()
+{
+  // Port D pin numbers equal their PCINT2 mask bits on the 328.
+  PCMSK2 = _BV(tpbPin) | _BV(sc1Pin) | _BV(n2Pin) | _BV(mreadPin);
+
+#if ELF_SWITCH_MATRIX
+  // PB0 is the matrix column return here; the IN key clocks the flip
+  // flop from loop() instead.
+  PCICR |= _BV(PCIE2);
+#else
+  // The IN switch on PB0 clocks the DMA flip flop via PCINT0.
+  PCMSK0 = _BV(0);
+  PCICR |= _BV(PCIE2) | _BV(PCIE0);
+#endif
+}
+
+// -----[ Serial burst loader ]---------------------------------------------
+// Toggling a 256 byte program in by hand takes minutes. The AVR already
+// owns the DMA-in, wait, clear and input latch lines, so with a 74HC595
+// feeding the data latch in place of the toggles it can replay the whole
+// manual load procedure at machine speed. Protocol on the hardware
+// UART: 'L', a length byte (0 means 256), then that many raw bytes;
+// each byte is clocked into Elf RAM with one DMA-in request while the
+// 1802 sits in load mode. A 256 byte image lands in well under a second.
+
+const unsigned long serialTimeoutMillis = 1000;
+
+// Read one byte from the host, or -1 if it stops talking.
+int readSerialByte()
+{
+  MillisDeadline deadline(serialTimeoutMillis);
+  while (Serial.available() == 0)
+  {
+    if (deadline.expired())
+      return -1;
+  }
+  return Serial.read();
+}
+
+// Present a byte on the 595's outputs. FastPin turns each bit into a
+// couple of instructions, so this beats shiftOut by an order of
+// magnitude and keeps the burst rate serial-bound.
+void expWriteByte(uint8_t b)
+{
+  for (uint8_t bit = 0x80; bit; bit >>= 1)
+  {
+    FastPin<expDataPin>::write(b & bit);
+    FastPin<expClockPin>::set();
+    FastPin<expClockPin>::clear();
+  }
+  FastPin<expLatchPin>::set();
+  FastPin<expLatchPin>::clear();
+}
+
+// Wait for the SC1 pulse that brackets the 1802's DMA cycle.
+bool waitForSc1Pulse()
+{
+  MicrosDeadline deadline(100000UL);
+  while ((readInputs() & sc1Bit) == 0)
+  {
+    if (deadline.expired())
+      return false;
+  }
+  while ((readInputs() & sc1Bit) != 0)
+  {
+    if (deadline.expired())
+      return false;
+  }
+  return true;
+}
+
+// Put the 1802 in load mode (/CLEAR and /WAIT both low) with the
+// data path from the 595 enabled. DMA-in idles high.
+void dmaLoadBegin()
+{
+#if ELF_SWITCH_MATRIX
+  // Claim the shift register chain; the scanner sits out until the
+  // burst is over rather than interleave clock pulses with ours.
+  expBusBusy = 1;
+#endif
+  FastPin<expEnablePin>::clear();
+  writeOutputs(dmaInMask | inputLatchMask);
+}
+
+// Clock one byte into Elf RAM with a DMA-in request, holding it until
+// the 1802 acknowledges with SC1, exactly one byte per request in
+// load mode.
+bool dmaLoadByte(uint8_t b)
+{
+  expWriteByte(b);
+  writeOutputs(inputLatchMask);
+  bool ok = waitForSc1Pulse();
+  writeOutputs(dmaInMask | inputLatchMask);
+  return ok;
+}
+
+// Put the toggles back in charge; the glue logic resumes from the
+// front panel switch state on the next loop pass. (A matrix build has
+// no separate toggles, so there the 595 stays on the bus and just goes
+// back to presenting the scanned data keys.)
+void dmaLoadEnd()
+{
+#if ELF_SWITCH_MATRIX
+  expBusBusy = 0;
+#else
+  FastPin<expEnablePin>::set();
+#endif
+}
+
+void burstLoad()
+{
+  int count = readSerialByte();
+  if (count < 0)
+    return;
+  int remaining = (count == 0) ? 256 : count;
+
+  dmaLoadBegin();
+
+  while (remaining-- > 0)
+  {
+    int b = readSerialByte();
+    if (b < 0 || !dmaLoadByte((uint8_t)b))
+      break;
+  }
+
+  dmaLoadEnd();
+}
+
+// -----[ Front panel switch matrix ]---------------------------------------
+// A full front panel wants eight data toggles plus IN, LOAD and RUN,
+// and this rig has exactly zero pins left. A matrix build reuses the
+// expansion header instead: a second 74HC595 cascaded behind the burst
+// loader's register drives the row strobes (no new pins — the row
+// pattern just shifts through first), and a 74HC165 returns the
+// strobed row's columns serially on PB0, sharing the expansion clock,
+// with its /PL load pulse derived from the inverted latch strobe. The
+// data keys live on row 0 and feed the loader 595's outputs
+// continuously, so the Elf's data latch sees them exactly like the old
+// toggles; IN, LOAD and RUN sit on row 1 and replace the dedicated
+// input pins.
+//
+// The Timer2 tick drives the scan, one row per millisecond: read the
+// columns the previous tick left settling, advance the row's vertical
+// counters, queue a change event, strobe the next row. Eight rows of
+// eight switches cost the same handful of bitwise ops per tick no
+// matter how many are closed, a full sweep takes 8 ms and the four
+// count counters mean a key must hold 24-32 ms to register. Events
+// travel to loop() through a PipeQueue, same as the status line
+// events.
+
+#if ELF_SWITCH_MATRIX
+
+const uint8_t matrixRows = 8;
+const uint8_t matrixDataRow = 0;     // the eight data keys
+const uint8_t matrixControlRow = 1;  // IN, LOAD, RUN in bits 0-2
+
+const uint8_t matrixInMask = 1 << 0;
+const uint8_t matrixLoadMask = 1 << 1;
+const uint8_t matrixRunMask = 1 << 2;
+
+// Debounced switch state per row, 1 = closed. Written by the scanner,
+// read by loop(); single bytes, so no locking.
+volatile uint8_t matrixState[matrixRows];
+
+// Change events: row in the high byte, the row's new state in the low.
+PipeQueue<uint16_t, 16> matrixQueue;
+
+// Shift the settled column levels out of the 165. The latch pulse
+// re-latches the rows to their current value (harmless) and loads the
+// 165 in the same edge; the eight clocks that follow scramble the 595
+// chain's shift stages, which the next strobe rewrites anyway.
+uint8_t matrixReadColumns()
+{
+  FastPin<expLatchPin>::set();
+  FastPin<expLatchPin>::clear();
+
+  uint8_t cols = 0;
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    cols = (cols << 1) | (FastPin<inPin>::read() ? 1 : 0);
+    FastPin<expClockPin>::set();
+    FastPin<expClockPin>::clear();
+  }
+  return cols;
+}
+
+// Drive one row strobe and re-present the data keys: the row pattern
+// shifts through the loader's 595 into the cascaded register, the data
+// byte lands behind it.
+void matrixStrobeRow(uint8_t row)
+{
+  expWriteByte(1 << row);
+  expWriteByte(matrixState[matrixDataRow]);
+}
+
+// One scanner step, called from the Timer2 ISR.
+void matrixScanTick()
+{
+  static uint8_t row;
+  static uint8_t plane0[matrixRows];
+  static uint8_t plane1[matrixRows];
+
+  if (expBusBusy)
+    return;
+
+  // The row strobed last tick has had a millisecond to settle.
+  uint8_t delta = matrixReadColumns() ^ matrixState[row];
+  plane1[row] = (plane1[row] ^ plane0[row]) & delta;
+  plane0[row] = ~plane0[row] & delta;
+
+  uint8_t settled = delta & ~(plane0[row] | plane1[row]);
+  if (settled)
+  {
+    matrixState[row] ^= settled;
+    if (row == matrixControlRow)
+      matrixLoadActive = (matrixState[row] & matrixLoadMask) != 0;
+
+    matrixQueue.put(((uint16_t)row << 8) | matrixState[row]);
+  }
+
+  row = (row + 1) & (matrixRows - 1);
+  matrixStrobeRow(row);
+}
+
+void matrixBegin()
+{
+  // No separate toggles on a matrix rig, so the loader 595 presents
+  // the data keys permanently.
+  FastPin<expEnablePin>::clear();
+  matrixStrobeRow(0);
+  FastPin<expLatchPin>::set();
+  FastPin<expLatchPin>::clear();
+}
+
+#endif // ELF_SWITCH_MATRIX
+
+// -----[ Program library ]-------------------------------------------------
+// Every power cycle loses Elf RAM, and re-toggling the standard bench
+// programs got old. A few canned 1802 images live in PROGMEM, two user
+// slots live in EEPROM, and any of them can be injected through the
+// DMA loader — including automatically at boot, before the operator
+// touches a switch. Commands: 'P<n>' loads program n now and releases
+// the machine into run mode, 'S<slot>' then a length byte and raw
+// bytes stores a user image (slots are programs 2 and 3), 'a<n>' picks
+// the boot autoload image ('a' alone disables it). Cold power-on to a
+// running program takes well under a second.
+
+// Program 0: toggle Q in a tight loop. SEQ / REQ / BR 0.
+const uint8_t progQBlink[] PROGMEM = { 0x7B, 0x7A, 0x30, 0x00 };
+
+// Program 1: echo the data switches to the display. INP 4 / OUT 4 /
+// BR 0, the classic first Elf program.
+const uint8_t progEcho[] PROGMEM = { 0x6C, 0x64, 0x30, 0x00 };
+
+struct ElfProgram
+{
+  const uint8_t * image;  // PROGMEM
+  uint8_t length;
+};
+
+const ElfProgram builtinPrograms[] =
+{
+  { progQBlink, sizeof(progQBlink) },
+  { progEcho, sizeof(progEcho) },
+};
+
+const uint8_t builtinCount = sizeof(builtinPrograms) / sizeof(builtinPrograms[0]);
+const uint8_t userSlotCount = 2;
+
+// EEPROM layout: the autoload selection byte, then the user slots,
+// each a length byte followed by up to 127 bytes of image.
+const int eepromAutoloadAddr = 0;
+const int eepromSlotBase = 16;
+const int eepromSlotSize = 128;
+
+// Drive outputs for a free running machine after a load: /CLEAR and
+// /WAIT high, DMA-in idle, display latch inactive.
+void releaseToRun()
+{
+  writeOutputs(clrMask | waitMask | dmaInMask | displayLatchMask);
+}
+
+// Inject program n (builtins first, then user slots) into Elf RAM and
+// set it running. Returns false for an empty or unknown slot.
+bool loadProgram(uint8_t n)
 {
-  // set clock high
-  digitalWrite(clockPin, HIGH);
+  // Resolve the image before touching the machine: entering load mode
+  // drops /CLEAR and /WAIT, and a stray index must not reset a running
+  // program only to leave it parked there.
+  const uint8_t * image = 0;  // PROGMEM source when set
+  int base = -1;              // EEPROM slot base otherwise
+  uint8_t length;
 
-  // Read all the input state.
-  int notIn = !debouncedDigitalRead(inPin);
-  int load = debouncedDigitalRead(loadPin);
-  int notMread = digitalRead(mreadPin);
-  int n2OrLoad = digitalRead(n2Pin) || load;
-  int run = debouncedDigitalRead(runPin);
-  int sc1OrNotLoad = digitalRead(sc1Pin) || !load;
-  int tpb = digitalRead(tpbPin);
+  if (n < builtinCount)
+  {
+    image = builtinPrograms[n].image;
+    length = builtinPrograms[n].length;
+  }
+  else if (n < builtinCount + userSlotCount)
+  {
+    base = eepromSlotBase + (n - builtinCount) * eepromSlotSize;
+    length = EEPROM.read(base);
+    if (length == 0 || length >= eepromSlotSize)
+      return false;  // empty or corrupt slot
+  }
+  else
+  {
+    return false;
+  }
+
+  dmaLoadBegin();
+  bool ok = true;
+  for (uint8_t i = 0; ok && i < length; i++)
+    ok = dmaLoadByte(image ? pgm_read_byte(image + i)
+                           : EEPROM.read(base + 1 + i));
+  dmaLoadEnd();
+
+  if (ok)
+    releaseToRun();
+  return ok;
+}
+
+// Receive a user image over serial ('S' <slot digit> <length> <bytes>)
+// into its EEPROM slot.
+void storeUserProgram()
+{
+  int slot = readSerialByte();
+  if (slot < '0' || slot >= '0' + userSlotCount)
+    return;
+
+  int length = readSerialByte();
+  if (length <= 0 || length >= eepromSlotSize)
+    return;
+
+  int base = eepromSlotBase + (slot - '0') * eepromSlotSize;
+  for (int i = 0; i < length; i++)
+  {
+    int b = readSerialByte();
+    if (b < 0)
+      return;  // incomplete image; leave the length unwritten
+    EEPROM.update(base + 1 + i, (uint8_t)b);
+  }
+  EEPROM.update(base, (uint8_t)length);
+}
+
+// Load the configured image at power-on, before the WAIT line is
+// released to the front panel.
+void autoload()
+{
+  uint8_t n = EEPROM.read(eepromAutoloadAddr);
+  if (n < builtinCount + userSlotCount)
+    loadProgram(n);
+}
 
-  // Compute flip flip state.
-  int notQ = flipFlop(notIn, sc1OrNotLoad);
+// -----[ Single step controller ]------------------------------------------
+// The WAIT line already belonged to this firmware, so it doubles as a
+// debugger: 'h' freezes the 1802 by asserting /WAIT, 's' (optionally
+// followed by a decimal count) releases it for exactly that many
+// machine cycles, and 'r' resumes free running. The cycle countdown
+// happens in the pin change ISR on TPB edges, so the step granularity
+// stays exact at any clock rate.
 
-  // Set the output pins.
-  digitalWrite(clrPin, run);
-  digitalWrite(displayLatchPin, !(!notMread && tpb && n2OrLoad) );
-  digitalWrite(dmaInPin, notQ);
-  digitalWrite(ef4Pin, load);
-  digitalWrite(inputLatchPin, notMread && n2OrLoad);
-  digitalWrite(waitPin, !load);
+// Like elfStep, the state and port updates run with interrupts off: a
+// torn two byte write of stepRemaining racing the ISR's decrement can
+// leave it nonzero, and the ISR would yank /WAIT low again right after
+// a resume.
+void elfHalt()
+{
+  noInterrupts();
+  elfHalted = 1;
+  stepRemaining = 0;
+  PORTB &= ~waitMask;
+  interrupts();
+}
 
-  // Set clock low
-  digitalWrite(clockPin, LOW);
+void elfResume()
+{
+  noInterrupts();
+  elfHalted = 0;
+  stepRemaining = 0;
+  PORTB |= waitMask;
+  interrupts();
 }
 
-int flipFlop(int notIn, int sc1OrNotLoad)
+void elfStep(unsigned int cycles)
 {
-  static int priorNotIn = HIGH;
+  if (!elfHalted || cycles == 0)
+    return;
 
-  // The DMA In pin is controlled by a D flip flip and is the
-  // most complicated. D is tied high, while S is low. Only clk
-  // and reset change value, with !Q used to set DMA In.
-  int notQ = HIGH;
+  // Release /WAIT; the ISR reasserts it after the last TPB edge.
+  noInterrupts();
+  stepRemaining = cycles;
+  PORTB |= waitMask;
+  interrupts();
+}
 
-  // First, detect a notIn edge trigger on clk.
-  if (priorNotIn == LOW && notIn != LOW)
+// Read an optional decimal count following a command letter.
+unsigned int readSerialCount(unsigned int fallback)
+{
+  unsigned int value = 0;
+  bool any = false;
+  int c;
+  while ((c = readSerialByte()) >= '0' && c <= '9')
   {
-    // On clock rising edge Q is set to the value of D, while
-    // notQ is set inverted. Since D is HIGH, notQ is LOW.
-    notQ = LOW;
-    priorNotIn = notIn;
+    value = value * 10 + (c - '0');
+    any = true;
   }
+  return any ? value : fallback;
+}
+
+// Dispatch single character commands from the host.
+void processSerial()
+{
+  if (Serial.available() == 0)
+    return;
 
-  // Now check the reset condition of the D flip flop.
-  if (sc1OrNotLoad)
+  switch (Serial.read())
   {
-    // On reset Q is set to LOW and notQ is set HIGH.
-    notQ = HIGH;
+    case 'L':
+      burstLoad();
+      break;
+
+    case 'P':
+      loadProgram((uint8_t)readSerialCount(0xFF));
+      break;
+
+    case 'S':
+      storeUserProgram();
+      break;
+
+    case 'a':
+      EEPROM.update(eepromAutoloadAddr, (uint8_t)readSerialCount(0xFF));
+      break;
+
+    case 'c':
+      // 'c<hz>' retunes the machine clock on the fly; 'c0' stops it.
+      elfClockSetHz(readSerialCount(defaultClockHz));
+      break;
+
+    case 'h':
+      elfHalt();
+      break;
+
+    case 's':
+      elfStep(readSerialCount(1));
+      break;
+
+    case 'r':
+      elfResume();
+      break;
+
+    case 'd':
+      traceDump();
+      break;
+
+#if ELF_PROFILING
+    case 'i':
+      statsReport();
+      break;
+#endif
+
+    default:
+      break;
   }
+}
+
+void setup()
+{
+  // Host link for the burst loader and control commands.
+  Serial.begin(115200);
+
+  FastPin<expDataPin>::modeOutput();
+  FastPin<expClockPin>::modeOutput();
+  FastPin<expLatchPin>::modeOutput();
+  FastPin<expEnablePin>::modeOutput();
+#if ELF_SWITCH_MATRIX
+  matrixBegin();  // scanner owns the expansion header from here on
+#else
+  FastPin<expEnablePin>::set();  // 595 off the bus until a burst.
+#endif
+
+  FastPin<clockPin>::modeOutput();
+  FastPin<clrPin>::modeOutput();
+  FastPin<dmaInPin>::modeOutput();
+  FastPin<waitPin>::modeOutput();
+  FastPin<displayLatchPin>::modeOutput();
+  FastPin<inputLatchPin>::modeOutput();
+
+  FastPin<inPin>::modeInput();
+  FastPin<loadPin>::modeInput();
+  FastPin<mreadPin>::modeInput();
+  FastPin<n2Pin>::modeInput();
+  FastPin<runPin>::modeInput();
+  FastPin<sc1Pin>::modeInput();
+  FastPin<tpbPin>::modeInput();
+
+  // Debounce every switch in parallel from the Timer2 tick.
+  debounceBegin();
 
-  return notQ;
+  // Watch the 1802 status lines with pin change interrupts.
+  eventsBegin();
+
+  // Start the machine clock.
+  elfClockSetHz(defaultClockHz);
+
+  // Inject the configured boot program, if any, before the front
+  // panel takes over.
+  autoload();
+
+#if ELF_PROFILING
+  statsReset();
+#endif
 }
 
-int debouncedDigitalRead(int pin) {
-  // the debounce time; increase if weirdness happens.
-  const int debounceDelay = 50;
+void loop()
+{
+  // The clock runs from Timer1 now; this loop just evaluates the glue
+  // logic at its own pace.
+  processSerial();
+
+  uint8_t in = readInputs();
+
+#if ELF_PROFILING
+  statsSample();
+#endif
 
-  // Do an intial read of button state.
-  int lastButtonState = digitalRead(pin);
+#if ELF_SWITCH_MATRIX
+  // Matrix builds take the panel switches from the scanned control
+  // row; the direct input pins only carry the 1802 status lines.
+  uint8_t controls = matrixState[matrixControlRow];
+  int load = (controls & matrixLoadMask) != 0;
 
-  // Wait the standard delay.
-  delay(debounceDelay);
+  // Drain the key change events. The state bytes above are already
+  // current; the queue exists so a press can't vanish between reads.
+  bool keysChanged = false;
+  uint16_t keyEvent;
+  while (matrixQueue.take(keyEvent))
+    keysChanged = true;
 
-  // read the state of the button again.
-  int reading = digitalRead(pin);
+  // PCINT0 watches the column return in this build, so the IN key
+  // clocks the flip flop here instead. A key press is orders of
+  // magnitude slower than a loop pass; nothing is lost.
+  noInterrupts();
+  dmaNotQ = dmaFlipFlop.update((controls & matrixInMask) == 0,
+                               ((in & sc1Bit) != 0) || !load);
+  interrupts();
+#else
+  // The Timer2 tick debounces the whole port in the background; just
+  // pick up the current stable levels.
+  uint8_t debounced = debouncedInputs;
+  int load = (debounced & loadBit) != 0;
+#endif
 
-  // Wait until the reading stabilizes.
-  while(reading != lastButtonState) {
-    lastButtonState = reading;
+  // Backstop for the flip flop's reset: if the load switch is off and
+  // no pin change has fired to notice, clear the request here.
+  if (!load && dmaNotQ == 0)
+  {
+    noInterrupts();
+    dmaFlipFlop.notQ = 1;
+    dmaNotQ = 1;
+    interrupts();
+  }
 
-    // read the state of the switch again.
-    reading = digitalRead(pin);
+  // Only re-evaluate the outputs when something actually moved: a
+  // debounced switch changed, the flip flop clocked or reset at
+  // interrupt time, or the status lines queued an event.
+  static uint8_t priorSwitches = 0xFF;
+#if ELF_SWITCH_MATRIX
+  // Map the control keys onto the packed pin-level bits: IN idles
+  // high, LOAD and RUN are active when closed.
+  uint8_t switches = ((controls & matrixInMask) ? 0 : inBit) |
+                     ((controls & matrixLoadMask) ? loadBit : 0) |
+                     ((controls & matrixRunMask) ? runBit : 0);
+#else
+  uint8_t switches = debounced & (inBit | loadBit | runBit);
+#endif
+  bool changed = (switches != priorSwitches);
+  priorSwitches = switches;
+#if ELF_SWITCH_MATRIX
+  changed = changed || keysChanged;
+#endif
 
-    // Wait the standard delay.
-    delay(debounceDelay);
+  uint8_t notQ = dmaNotQ;
+  static uint8_t priorNotQ = 1;
+  changed = changed || (notQ != priorNotQ);
+  priorNotQ = notQ;
+
+  // Drain the status line events; the latest snapshot wins.
+  uint8_t event;
+  while (eventQueue.take(event))
+  {
+    in = event;
+    changed = true;
   }
 
-  return reading;
+  if (!changed)
+    return;
+
+  // Build the table index: the sampled status lines with the debounced
+  // switch levels folded back in, plus the flip flop bit on top. The
+  // flip flop itself runs at interrupt time now; its level was picked
+  // up above.
+  uint8_t idx = (in & ~(inBit | loadBit | runBit)) | switches;
+  if (notQ)
+    idx |= notQBit;
+
+  // One table fetch and one port write sets every output.
+  writeOutputs(pgm_read_byte(&logicLut[idx]));
 }
 
+
@@ -0,0 +1,88 @@
+/**
+ * ** Elf glue logic core **
+ * The combinational equations and the DMA-in flip flop, factored out of
+ * the sketch so the same code compiles for the AVR and as a native
+ * host binary. This header is pure: no Arduino, no ports, just packed
+ * bytes in and packed bytes out. The sketch's readInputs() and
+ * writeOutputs() are the hardware side of the seam, and sim/ holds a
+ * host test driver that can push millions of synthetic vectors per
+ * second through these functions and check them against the schematic.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#ifndef ELFLOGIC_H
+#define ELFLOGIC_H
+
+#include <stdint.h>
+
+// Packed input byte layout. readInputs() in the sketch must produce
+// this: pins 2-7 shifted down to bits 0-5, the IN switch in bit 6 and
+// the flip flop state stacked on top in bit 7.
+const uint8_t tpbBit = 1 << 0;
+const uint8_t sc1Bit = 1 << 1;
+const uint8_t runBit = 1 << 2;
+const uint8_t n2Bit = 1 << 3;
+const uint8_t mreadBit = 1 << 4;
+const uint8_t loadBit = 1 << 5;
+const uint8_t inBit = 1 << 6;
+const uint8_t notQBit = 1 << 7;
+
+// Packed output byte layout. These match the AVR port alignment that
+// writeOutputs() relies on (bit 0 is CLR on PORTC, bits 1-5 are PB1-PB5),
+// which in turn follows from the output pin assignment in the sketch.
+const uint8_t elfOutClr = 1 << 0;
+const uint8_t elfOutDmaIn = 1 << 1;
+const uint8_t elfOutInputLatch = 1 << 2;
+const uint8_t elfOutDisplayLatch = 1 << 3;
+const uint8_t elfOutWait = 1 << 4;
+const uint8_t elfOutEf4 = 1 << 5;
+
+// The combinational equations from the Elf schematic as one constant
+// expression, so the sketch can unroll it into a PROGMEM table at
+// compile time and the simulator can call it directly.
+#define ELF_IN(idx, bit) (((idx) & (bit)) != 0)
+
+constexpr uint8_t elfLogicCompute(uint8_t idx)
+{
+  return (uint8_t)(
+    (ELF_IN(idx, runBit) ? elfOutClr : 0) |
+    (!(!ELF_IN(idx, mreadBit) && ELF_IN(idx, tpbBit) &&
+       (ELF_IN(idx, n2Bit) || ELF_IN(idx, loadBit))) ? elfOutDisplayLatch : 0) |
+    (ELF_IN(idx, notQBit) ? elfOutDmaIn : 0) |
+    (ELF_IN(idx, loadBit) ? elfOutEf4 : 0) |
+    ((ELF_IN(idx, mreadBit) &&
+      (ELF_IN(idx, n2Bit) || ELF_IN(idx, loadBit))) ? elfOutInputLatch : 0) |
+    (!ELF_IN(idx, loadBit) ? elfOutWait : 0));
+}
+
+// The DMA In pin is controlled by a D flip flop. D is tied high, while
+// S is low. Only clk and reset change value, with !Q used to set DMA
+// In: a rising edge on notIn clocks D through (notQ goes low) and the
+// async reset (SC1 or not-load) forces notQ high again, overriding the
+// clock. notQ is real state — it holds low after the edge until reset,
+// which is what lets the 1802 see the DMA request for a full cycle.
+struct ElfFlipFlop
+{
+  uint8_t priorNotIn;
+  uint8_t notQ;
+
+  ElfFlipFlop() : priorNotIn(1), notQ(1) {}
+
+  uint8_t update(uint8_t notIn, uint8_t sc1OrNotLoad)
+  {
+    // First, detect a notIn rising edge on clk.
+    if (!priorNotIn && notIn)
+      notQ = 0;
+    priorNotIn = notIn;
+
+    // The reset condition is asynchronous and wins over the clock.
+    if (sc1OrNotLoad)
+      notQ = 1;
+
+    return notQ;
+  }
+};
+
+#endif // ELFLOGIC_H
@@ -0,0 +1,74 @@
+/**
+ * ** FastPin - compile time pin access for AVR **
+ * The Arduino digitalRead/digitalWrite calls look the port, mask and
+ * timer for a pin up in PROGMEM tables on every call, which costs 50+
+ * cycles each. When the pin number is a compile time constant all of
+ * that can be resolved by the compiler instead: FastPin<N> maps the pin
+ * to its port, direction and input registers and bit mask at compile
+ * time, so set()/clear()/read() compile down to single sbi/cbi/sbic
+ * instructions. Both sketches in this repo lean on it for their hot
+ * paths.
+ *
+ * The mapping below is for the ATmega168/328 family (Uno and friends):
+ * digital pins 0-7 on PORTD, 8-13 on PORTB, A0-A5 (14-19) on PORTC.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#ifndef FASTPIN_H
+#define FASTPIN_H
+
+#include <avr/io.h>
+
+#if !defined(__AVR_ATmega328P__) && !defined(__AVR_ATmega328__) && \
+    !defined(__AVR_ATmega168__) && !defined(__AVR_ATmega8__)
+#error "FastPin only knows the ATmega8/168/328 pin mapping."
+#endif
+
+template <uint8_t PIN>
+class FastPin
+{
+  static_assert(PIN <= 19, "FastPin: no such pin on this part");
+
+public:
+  // The port bit this pin occupies, usable in constant expressions.
+  static constexpr uint8_t mask()
+  {
+    return PIN < 8 ? (1 << PIN)
+         : PIN < 14 ? (1 << (PIN - 8))
+         : (1 << (PIN - 14));
+  }
+
+  static void modeOutput() { *ddrReg() |= mask(); }
+  static void modeInput() { *ddrReg() &= ~mask(); }
+  static void modeInputPullup() { modeInput(); set(); }
+
+  // Single instruction sbi/cbi on I/O space ports.
+  static void set() { *portReg() |= mask(); }
+  static void clear() { *portReg() &= ~mask(); }
+  static void write(uint8_t value) { if (value) set(); else clear(); }
+
+  // Writing the bit to the input register toggles the output latch.
+  static void toggle() { *pinReg() = mask(); }
+
+  static uint8_t read() { return (*pinReg() & mask()) != 0; }
+
+private:
+  static volatile uint8_t * portReg()
+  {
+    return PIN < 8 ? &PORTD : PIN < 14 ? &PORTB : &PORTC;
+  }
+
+  static volatile uint8_t * ddrReg()
+  {
+    return PIN < 8 ? &DDRD : PIN < 14 ? &DDRB : &DDRC;
+  }
+
+  static volatile uint8_t * pinReg()
+  {
+    return PIN < 8 ? &PIND : PIN < 14 ? &PINB : &PINC;
+  }
+};
+
+#endif // FASTPIN_H
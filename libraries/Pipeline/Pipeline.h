@@ -0,0 +1,74 @@
+/**
+ * ** Pipeline - the capture/process/emit skeleton shared by the sketches **
+ * Both sketches ended up with the same shape: an ISR captures events
+ * into a ring, loop() processes whatever has arrived without blocking,
+ * and output drains through another ring no faster than the hardware
+ * can take it. That lets all three stages overlap — the UART transmits
+ * one batch while the next computes and the ISRs keep capturing — so
+ * sustained throughput tracks the slowest stage instead of the sum of
+ * every stage's latency. Each sketch had grown its own copy of the
+ * ring; this header defines the one they all mean:
+ *
+ *  - PipeQueue<T, SIZE>: a single-producer single-consumer ring for a
+ *    power-of-two number of entries. One side may be an ISR with no
+ *    locking beyond the byte-wide indices: the producer only writes
+ *    the head, the consumer only the tail, and each index is updated
+ *    after its entry is safely in or out. put() refuses rather than
+ *    overwrites when full, so the producer decides what dropping means
+ *    (count it, coalesce, or stall).
+ *
+ * The stages themselves stay plain functions in the sketches — a stage
+ * here is just "runs without blocking and talks to its neighbors
+ * through a PipeQueue", which PolledTask's deadlines and tasks already
+ * make easy to keep true.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <Arduino.h>
+
+template <typename T, uint8_t SIZE>
+class PipeQueue
+{
+public:
+  PipeQueue() : _head(0), _tail(0) {}
+
+  // Producer side; false means full, the entry was not queued.
+  bool put(const T & value)
+  {
+    uint8_t next = (_head + 1) & (SIZE - 1);
+    if (next == _tail)
+      return false;
+    _entries[_head] = value;
+    _head = next;
+    return true;
+  }
+
+  // Consumer side; false means empty, value is untouched.
+  bool take(T & value)
+  {
+    if (_tail == _head)
+      return false;
+    value = _entries[_tail];
+    _tail = (_tail + 1) & (SIZE - 1);
+    return true;
+  }
+
+  uint8_t available() const { return (uint8_t)(_head - _tail) & (SIZE - 1); }
+  uint8_t free() const { return (uint8_t)(SIZE - 1) - available(); }
+  bool empty() const { return _head == _tail; }
+
+private:
+  static_assert(SIZE > 1 && (SIZE & (SIZE - 1)) == 0,
+                "SIZE must be a power of two");
+
+  volatile T _entries[SIZE];
+  volatile uint8_t _head;  // written only by the producer
+  volatile uint8_t _tail;  // written only by the consumer
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,86 @@
+/**
+ * ** PolledTask - cooperative timing without delay() **
+ * Every piece of timing in this repo used to be a stall: delay() in
+ * the debounce paths, busy-waits on serial. This header gives the
+ * sketches the two tools that replace all of that, with no heap and no
+ * interrupts of its own:
+ *
+ *  - PolledTask: a fixed static table of repeat-every-N-ms functions,
+ *    pumped from loop() by runTasks(). A task that isn't due costs one
+ *    subtraction and a compare.
+ *
+ *  - MillisDeadline / MicrosDeadline: one-shot timeouts for the
+ *    "give up if this takes too long" pattern, polled inline instead
+ *    of waited on.
+ *
+ * Both use unsigned subtraction against millis()/micros(), so they
+ * survive the counter wrapping.
+ *
+ * Copyright (c) by Martin Heermance
+ * MIT Licensed
+ **/
+
+#ifndef POLLEDTASK_H
+#define POLLEDTASK_H
+
+#include <Arduino.h>
+
+// One entry in a sketch's static task table.
+struct PolledTask
+{
+  void (*run)();
+  unsigned long intervalMillis;
+  unsigned long lastMillis;
+};
+
+// Pump the table; call this every loop() pass. Due tasks run once and
+// reschedule from their nominal time, so a late pass doesn't make the
+// cadence drift.
+inline void runTasks(PolledTask * tasks, uint8_t count)
+{
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (now - tasks[i].lastMillis >= tasks[i].intervalMillis)
+    {
+      tasks[i].lastMillis += tasks[i].intervalMillis;
+      tasks[i].run();
+    }
+  }
+}
+
+// One-shot millisecond timeout: construct it, then poll expired().
+class MillisDeadline
+{
+public:
+  explicit MillisDeadline(unsigned long timeoutMillis)
+    : _start(millis()),
+      _timeout(timeoutMillis)
+  {
+  }
+
+  bool expired() const { return millis() - _start >= _timeout; }
+
+private:
+  unsigned long _start;
+  unsigned long _timeout;
+};
+
+// The same thing on the micros() clock for short waits.
+class MicrosDeadline
+{
+public:
+  explicit MicrosDeadline(unsigned long timeoutMicros)
+    : _start(micros()),
+      _timeout(timeoutMicros)
+  {
+  }
+
+  bool expired() const { return micros() - _start >= _timeout; }
+
+private:
+  unsigned long _start;
+  unsigned long _timeout;
+};
+
+#endif // POLLEDTASK_H